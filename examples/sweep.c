@@ -0,0 +1,181 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sweep over all functions of an x86-64 ELF file and report the instructions
+ * which could not be lifted, most frequent first.
+ *
+ * Usage: sweep <elf-file> [count]
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <llvm-c/Core.h>
+
+#include <fadec.h>
+#include <rellume/rellume.h>
+
+
+struct Image {
+    const uint8_t* data;
+    const Elf64_Shdr* shdrs;
+    size_t shnum;
+};
+
+static const Elf64_Shdr*
+find_exec_section(const struct Image* img, uint64_t addr)
+{
+    for (size_t i = 0; i < img->shnum; i++) {
+        const Elf64_Shdr* shdr = &img->shdrs[i];
+        if (shdr->sh_type != SHT_PROGBITS || !(shdr->sh_flags & SHF_EXECINSTR))
+            continue;
+        if (addr >= shdr->sh_addr && addr - shdr->sh_addr < shdr->sh_size)
+            return shdr;
+    }
+    return NULL;
+}
+
+static size_t
+read_image(size_t addr, uint8_t* buf, size_t size, void* user_arg)
+{
+    const struct Image* img = user_arg;
+    const Elf64_Shdr* shdr = find_exec_section(img, addr);
+    if (!shdr)
+        return 0;
+    size_t off = addr - shdr->sh_addr;
+    if (size > shdr->sh_size - off)
+        size = shdr->sh_size - off;
+    memcpy(buf, img->data + shdr->sh_offset + off, size);
+    return size;
+}
+
+static void
+sweep_function(LLConfig* cfg, struct Image* img, uint64_t addr)
+{
+    LLVMModuleRef mod = LLVMModuleCreateWithName("sweep");
+    LLFunc* fn = ll_func_new(mod, cfg);
+    // The histogram is filled while decoding, lifting is not needed.
+    ll_func_decode_cfg(fn, addr, read_image, img);
+    ll_func_dispose(fn);
+    LLVMDisposeModule(mod);
+}
+
+int
+main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <elf-file> [count]\n", argv[0]);
+        return 1;
+    }
+    size_t max_entries = argc > 2 ? strtoul(argv[2], NULL, 0) : 20;
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("open");
+        return 1;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const Elf64_Ehdr* ehdr = data;
+    if ((size_t) st.st_size < sizeof(*ehdr) ||
+        memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_machine != EM_X86_64 ||
+        ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) >
+            (size_t) st.st_size) {
+        fprintf(stderr, "%s: not an x86-64 ELF file\n", argv[1]);
+        return 1;
+    }
+
+    struct Image img = {
+        .data = data,
+        .shdrs = (const Elf64_Shdr*) ((const uint8_t*) data + ehdr->e_shoff),
+        .shnum = ehdr->e_shnum,
+    };
+
+    LLConfig* cfg = ll_config_new();
+    ll_unsupported_instrs_reset();
+
+    // Start at every function symbol; without symbols, start at the beginning
+    // of every executable section.
+    size_t num_funcs = 0;
+    for (size_t i = 0; i < img.shnum; i++) {
+        const Elf64_Shdr* shdr = &img.shdrs[i];
+        if (shdr->sh_type != SHT_SYMTAB && shdr->sh_type != SHT_DYNSYM)
+            continue;
+        const Elf64_Sym* syms =
+            (const Elf64_Sym*) (img.data + shdr->sh_offset);
+        for (size_t j = 0; j < shdr->sh_size / sizeof(Elf64_Sym); j++) {
+            if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC ||
+                !find_exec_section(&img, syms[j].st_value))
+                continue;
+            sweep_function(cfg, &img, syms[j].st_value);
+            num_funcs++;
+        }
+    }
+    if (num_funcs == 0) {
+        for (size_t i = 0; i < img.shnum; i++) {
+            const Elf64_Shdr* shdr = &img.shdrs[i];
+            if (find_exec_section(&img, shdr->sh_addr) != shdr)
+                continue;
+            sweep_function(cfg, &img, shdr->sh_addr);
+            num_funcs++;
+        }
+    }
+
+    size_t num_entries = ll_unsupported_instrs(NULL, 0);
+    LLUnsupportedInstr* entries = calloc(num_entries, sizeof(*entries));
+    ll_unsupported_instrs(entries, num_entries);
+
+    printf("%zu functions, %zu unsupported instruction types\n", num_funcs,
+           num_entries);
+    printf("%10s  %-18s  %s\n", "count", "first address", "example");
+    for (size_t i = 0; i < num_entries && i < max_entries; i++) {
+        // Decode the first occurrence again for a readable example.
+        uint8_t buf[15];
+        char fmt[128] = "(invalid)";
+        FdInstr instr;
+        size_t len = read_image(entries[i].first_addr, buf, sizeof buf, &img);
+        if (fd_decode(buf, len, 64, entries[i].first_addr, &instr) > 0)
+            fd_format(&instr, fmt, sizeof fmt);
+        printf("%10llu  0x%016llx  %s\n",
+               (unsigned long long) entries[i].count,
+               (unsigned long long) entries[i].first_addr, fmt);
+    }
+
+    free(entries);
+    ll_config_free(cfg);
+    munmap(data, st.st_size);
+
+    return 0;
+}
@@ -45,20 +45,36 @@ RELLUME_API LLConfig* ll_config_new(void);
 RELLUME_API void ll_config_free(LLConfig*);
 
 RELLUME_API void ll_config_set_hhvm(LLConfig*, bool);
+RELLUME_API void ll_config_set_regcall(LLConfig*, unsigned vec_regs);
 RELLUME_API void ll_config_set_sptr_addrspace(LLConfig*, unsigned);
 RELLUME_API void ll_config_enable_overflow_intrinsics(LLConfig*, bool);
 RELLUME_API void ll_config_enable_fast_math(LLConfig*, bool);
+RELLUME_API void ll_config_enable_x87_double(LLConfig*, bool);
 RELLUME_API void ll_config_enable_verify_ir(LLConfig*, bool);
 RELLUME_API void ll_config_set_position_independent_code(LLConfig*, bool);
 RELLUME_API void ll_config_set_global_base(LLConfig*, uintptr_t, LLVMValueRef);
+RELLUME_API void ll_config_set_sandbox(LLConfig*, LLVMValueRef base,
+                                       uint64_t mask);
+RELLUME_API void ll_config_set_tlb(LLConfig*, LLVMValueRef tlb, unsigned bits,
+                                   unsigned page_bits, LLVMValueRef miss_fn);
 RELLUME_API void ll_config_set_instr_impl(LLConfig*, FdInstrType, LLVMValueRef);
 RELLUME_API void ll_config_set_tail_func(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_call_func(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_native_call(LLConfig*, uint64_t, LLVMValueRef);
+RELLUME_API void ll_config_set_shadow_ret_stack(LLConfig*, LLVMValueRef stack,
+                                                LLVMValueRef mismatch_fn);
 RELLUME_API void ll_config_set_syscall_impl(LLConfig*, LLVMValueRef);
 RELLUME_API void ll_config_set_instr_marker(LLConfig*, LLVMValueRef);
+RELLUME_API void ll_config_set_edge_coverage(LLConfig*, LLVMValueRef map,
+                                             unsigned map_bits,
+                                             LLVMValueRef prev_loc);
 RELLUME_API void ll_config_set_call_ret_clobber_flags(LLConfig*, bool);
 RELLUME_API void ll_config_set_use_native_segment_base(LLConfig*, bool);
 RELLUME_API void ll_config_enable_full_facets(LLConfig*, bool);
+RELLUME_API void ll_config_enable_adaptive_facets(LLConfig*, bool);
+RELLUME_API void ll_config_enable_string_libcalls(LLConfig*, bool);
+RELLUME_API void ll_config_enable_rip_stackmaps(LLConfig*, bool);
+RELLUME_API void ll_config_enable_abi_stack_alignment(LLConfig*, bool);
 
 
 typedef struct LLFunc LLFunc;
@@ -78,13 +94,81 @@ RELLUME_API int ll_func_decode_block(LLFunc* func, uintptr_t addr,
 RELLUME_API int ll_func_decode_cfg(LLFunc* func, uintptr_t addr,
                                    RellumeMemAccessCb cb, void* user_arg);
 
+typedef struct LLUnsupportedInstr {
+    FdInstrType type;
+    uint64_t count;
+    uint64_t first_addr;
+} LLUnsupportedInstr;
+RELLUME_API size_t ll_func_unsupported_instrs(LLFunc* func,
+                                              LLUnsupportedInstr* buf,
+                                              size_t size);
+RELLUME_API size_t ll_unsupported_instrs(LLUnsupportedInstr* buf, size_t size);
+RELLUME_API void ll_unsupported_instrs_reset(void);
+
 RELLUME_API void ll_func_fast_opt(LLVMValueRef llvm_fn) RELLUME_DEPRECATED;
 RELLUME_API LLVMValueRef ll_func_wrap_sysv(LLVMValueRef llvm_fn, LLVMTypeRef ty,
                                            LLVMModuleRef mod,
                                            size_t stack_sz) RELLUME_DEPRECATED;
 
+typedef struct LLBlockCache LLBlockCache;
+typedef void(* LLBlockCacheCompileCb)(LLVMModuleRef mod, size_t count,
+                                      LLVMValueRef* fns, void** code,
+                                      void* user_arg);
+RELLUME_API LLBlockCache* ll_block_cache_new(LLConfig*, LLVMContextRef,
+                                             LLBlockCacheCompileCb cb,
+                                             void* user_arg);
+RELLUME_API void ll_block_cache_dispose(LLBlockCache*);
+RELLUME_API void* ll_block_cache_lookup(LLBlockCache*, uint64_t addr);
+RELLUME_API int ll_block_cache_add(LLBlockCache*, uint64_t addr,
+                                   RellumeMemAccessCb cb, void* user_arg);
+RELLUME_API int ll_block_cache_flush(LLBlockCache*);
+RELLUME_API void* ll_block_cache_translate(LLBlockCache*, uint64_t addr,
+                                           RellumeMemAccessCb cb,
+                                           void* user_arg);
+RELLUME_API void ll_block_cache_invalidate(LLBlockCache*, uint64_t start,
+                                           uint64_t end);
+
+RELLUME_API uint64_t ll_stackmap_lookup(const void* stackmaps, size_t size,
+                                        uintptr_t host_pc);
+
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(__cplusplus) && defined(RELLUME_ENABLE_CPP_HEADER)
+
+#include <llvm/ADT/ArrayRef.h>
+
+namespace llvm {
+class Function;
+}
+
+namespace rellume {
+
+struct LLConfig;
+class Function;
+
+inline LLConfig* unwrap(::LLConfig* cfg) {
+    return reinterpret_cast<LLConfig*>(cfg);
+}
+inline Function* unwrap(LLFunc* fn) {
+    return reinterpret_cast<Function*>(fn);
+}
+
+enum class DecodeStop {
+    INSTR,
+    BASICBLOCK,
+    ALL,
+};
+
+RELLUME_API int Decode(Function* fn, uintptr_t addr, DecodeStop stop,
+                       RellumeMemAccessCb cb, void* user_arg);
+RELLUME_API int Decode(Function* fn, uintptr_t addr, DecodeStop stop,
+                       llvm::ArrayRef<uint8_t> code, uintptr_t code_addr);
+RELLUME_API llvm::Function* Lift(Function* fn);
+
+} // namespace rellume
+
+#endif
+
 #endif
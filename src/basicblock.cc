@@ -30,6 +30,7 @@
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Metadata.h>
 #include <cstdio>
 #include <deque>
@@ -56,7 +57,8 @@ BasicBlock::BasicBlock(llvm::Function* fn, Phis phi_mode)
         // Initialize all registers with a generator which adds a PHI node when
         // the value-facet combination is requested.
         empty_phis.reserve(32);
-        regfile.InitWithPHIs(&empty_phis, /*all=*/phi_mode == Phis::ALL);
+        regfile.InitWithPHIs(&empty_phis, /*all=*/phi_mode != Phis::NATIVE,
+                             /*weak=*/phi_mode == Phis::ADAPTIVE);
     }
 }
 
@@ -70,7 +72,7 @@ void BasicBlock::BranchTo(BasicBlock& next) {
 }
 
 void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
-                             BasicBlock& other) {
+                          BasicBlock& other, Likely likely) {
     // In case both blocks are the same create a single branch only.
     if (std::addressof(then) == std::addressof(other)) {
         BranchTo(then);
@@ -79,8 +81,16 @@ void BasicBlock::BranchTo(llvm::Value* cond, BasicBlock& then,
 
     assert(!llvm_block->getTerminator() && "attempting to add second terminator");
 
+    // Use the same weights as __builtin_expect.
+    llvm::MDNode* weights = nullptr;
+    llvm::MDBuilder mdb(llvm_block->getContext());
+    if (likely == Likely::THEN)
+        weights = mdb.createBranchWeights(2000, 1);
+    else if (likely == Likely::OTHER)
+        weights = mdb.createBranchWeights(1, 2000);
+
     llvm::IRBuilder<> irb(llvm_block);
-    irb.CreateCondBr(cond, then.llvm_block, other.llvm_block);
+    irb.CreateCondBr(cond, then.llvm_block, other.llvm_block, weights);
     then.predecessors.push_back(this);
     other.predecessors.push_back(this);
     successors.push_back(&then);
@@ -101,7 +111,10 @@ bool BasicBlock::FillPhis() {
             continue;
         }
         for (BasicBlock* pred : predecessors) {
-            llvm::Value* value = pred->regfile.GetReg(reg, facet);
+            // Don't create new PHIs of other facets in the predecessor, but
+            // use the facet only if it is already there.
+            llvm::Value* value = pred->regfile.GetReg(reg, facet,
+                                                      /*weak_phis=*/false);
             if (facet == Facet::PTR && value->getType() != phi->getType()) {
                 llvm::IRBuilder<> irb(pred->llvm_block->getTerminator());
                 value = irb.CreatePointerCast(value, phi->getType());
@@ -36,7 +36,9 @@ namespace rellume {
 
 class BasicBlock {
 public:
-    enum class Phis { NONE, NATIVE, ALL };
+    enum class Phis { NONE, NATIVE, ADAPTIVE, ALL };
+    /// Expected direction of a conditional branch, emitted as branch weights.
+    enum class Likely { NONE, THEN, OTHER };
 
     BasicBlock(llvm::Function* fn, Phis phi_mode);
 
@@ -47,13 +49,20 @@ public:
     BasicBlock& operator=(const BasicBlock&) = delete;
 
     void BranchTo(BasicBlock& next);
-    void BranchTo(llvm::Value* cond, BasicBlock& then, BasicBlock& other);
+    void BranchTo(llvm::Value* cond, BasicBlock& then, BasicBlock& other,
+                  Likely likely = Likely::NONE);
     bool FillPhis();
 
     RegFile* GetRegFile() {
         return &regfile;
     }
 
+    /// Move the LLVM basic block after pos, returns the moved block.
+    llvm::BasicBlock* MoveAfter(llvm::BasicBlock* pos) {
+        llvm_block->moveAfter(pos);
+        return llvm_block;
+    }
+
     const std::vector<BasicBlock*>& Predecessors() const {
         return predecessors;
     }
@@ -81,6 +90,7 @@ private:
 
     std::vector<std::unique_ptr<BasicBlock>> low_blocks;
     BasicBlock* insert_block;
+    bool cold = false;
 
 public:
     ArchBasicBlock(llvm::Function* fn, BasicBlock::Phis phi_mode)
@@ -115,8 +125,19 @@ public:
     void BranchTo(ArchBasicBlock& next) {
         insert_block->BranchTo(next.BeginBlock());
     }
-    void BranchTo(llvm::Value* cond, ArchBasicBlock& then, ArchBasicBlock& other) {
-        insert_block->BranchTo(cond, then.BeginBlock(), other.BeginBlock());
+    void BranchTo(llvm::Value* cond, ArchBasicBlock& then, ArchBasicBlock& other,
+                  BasicBlock::Likely likely = BasicBlock::Likely::NONE) {
+        insert_block->BranchTo(cond, then.BeginBlock(), other.BeginBlock(),
+                               likely);
+    }
+
+    /// Cold blocks are rarely executed, e.g. because they end with a trap or
+    /// an instruction which cannot be lifted and leave the function.
+    bool IsCold() const {
+        return cold;
+    }
+    void SetCold() {
+        cold = true;
     }
     bool FillPhis() {
         bool res = false;
@@ -124,6 +145,13 @@ public:
             res |= lb->FillPhis();
         return res;
     }
+    /// Move all LLVM basic blocks after pos, keeping their relative order.
+    /// Returns the last moved block.
+    llvm::BasicBlock* MoveAfter(llvm::BasicBlock* pos) {
+        for (const auto& lb : low_blocks)
+            pos = lb->MoveAfter(pos);
+        return pos;
+    }
 };
 
 }
@@ -0,0 +1,321 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "blockcache.h"
+
+#include "config.h"
+#include "function.h"
+#include "function-info.h"
+
+#include <llvm-c/Core.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+namespace rellume {
+
+namespace {
+
+/// Forwards reads to the user callback (or host memory) and records the
+/// range of guest memory the block was decoded from.
+struct RangeReader {
+    RellumeMemAccessCb memacc;
+    void* user_arg;
+    uint64_t start;
+    uint64_t end;
+
+    static size_t Read(size_t addr, uint8_t* buf, size_t size, void* arg) {
+        auto* reader = static_cast<RangeReader*>(arg);
+        if (reader->memacc)
+            size = reader->memacc(addr, buf, size, reader->user_arg);
+        else
+            std::memcpy(buf, reinterpret_cast<uint8_t*>(addr), size);
+        reader->start = std::min<uint64_t>(reader->start, addr);
+        reader->end = std::max<uint64_t>(reader->end, addr + size);
+        return size;
+    }
+};
+
+} // namespace
+
+static int64_t SptrOffset(SptrIdx::Idx idx) {
+    switch (idx) {
+#define RELLUME_NAMED_REG(name,nameu,sz,off) case SptrIdx::nameu: return off;
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+    default: return -1;
+    }
+}
+
+/// Find the value stored to RIP in the CPU struct before ret.
+static llvm::Value* StoredRip(llvm::ReturnInst* ret, llvm::Value* sptr) {
+    const llvm::DataLayout& dl = ret->getModule()->getDataLayout();
+    for (auto it = ret->getReverseIterator(), e = ret->getParent()->rend();
+         it != e; ++it) {
+        if (llvm::isa<llvm::CallInst>(&*it))
+            break;
+        auto* store = llvm::dyn_cast<llvm::StoreInst>(&*it);
+        if (!store)
+            continue;
+        int64_t off;
+        llvm::Value* ptr = store->getPointerOperand();
+        if (llvm::GetPointerBaseWithConstantOffset(ptr, off, dl) == sptr &&
+            off == SptrOffset(SptrIdx::RIP))
+            return store->getValueOperand();
+    }
+    return nullptr;
+}
+
+void* BlockCache::Lookup(uint64_t addr) const {
+    auto it = blocks.find(addr);
+    return it != blocks.end() ? it->second.code : nullptr;
+}
+
+bool BlockCache::Add(uint64_t addr, RellumeMemAccessCb memacc,
+                     void* memacc_arg) {
+    if (blocks.count(addr))
+        return true;
+    if (!batch)
+        batch = std::make_unique<llvm::Module>("rellume_blocks", ctx);
+
+    RangeReader reader{memacc, memacc_arg, addr, addr};
+    Function fn(batch.get(), cfg);
+    if (fn.Decode(addr, DecodeStop::BASICBLOCK, RangeReader::Read, &reader))
+        return false;
+    llvm::Function* llvm_fn = fn.Lift();
+    if (!llvm_fn)
+        return false;
+    llvm_fn->setName("rl_block_" + llvm::utohexstr(addr));
+
+    blocks[addr] = Block{reader.start, reader.end, llvm_fn, nullptr, {}};
+    pending.push_back(addr);
+    return true;
+}
+
+llvm::Value* BlockCache::ChainTarget(llvm::Function* fn, uint64_t addr) {
+    auto it = blocks.find(addr);
+    if (it == blocks.end())
+        return nullptr;
+    if (it->second.fn)
+        return it->second.fn;
+    auto code = reinterpret_cast<uintptr_t>(it->second.code);
+    llvm::Constant* code_addr = llvm::ConstantInt::get(ctx,
+                                                       llvm::APInt(64, code));
+    return llvm::ConstantExpr::getIntToPtr(code_addr, fn->getType());
+}
+
+void BlockCache::Chain(Block& block) {
+    // Chaining relies on the callee having the same signature and reading
+    // the whole state from the CPU struct.
+    llvm::Function* fn = block.fn;
+    if (cfg->callconv != CallConv::SPTR || cfg->tail_function ||
+        !fn->getReturnType()->isVoidTy())
+        return;
+
+    llvm::Value* sptr = &fn->arg_begin()[0];
+    llvm::SmallVector<llvm::ReturnInst*, 2> rets;
+    for (llvm::BasicBlock& bb : *fn)
+        if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator()))
+            rets.push_back(ret);
+
+    auto chain_call = [&] (llvm::IRBuilder<>& irb, llvm::Value* callee) {
+        llvm::CallInst* call = irb.CreateCall(fn->getFunctionType(), callee,
+                                              {sptr});
+        call->setCallingConv(fn->getCallingConv());
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    };
+
+    // Tail call target in the empty chain_bb. Blocks not lifted yet are called
+    // through their slot, which is filled when they are compiled; while it is
+    // empty, branch to dispatch.
+    auto chain_block = [&] (llvm::BasicBlock* chain_bb, uint64_t target,
+                            llvm::BasicBlock* dispatch) {
+        llvm::IRBuilder<> irb(chain_bb);
+        llvm::Value* callee = ChainTarget(fn, target);
+        if (callee) {
+            chain_preds[target].insert(block.start);
+            block.succs.push_back(target);
+        } else {
+            auto slot = reinterpret_cast<uintptr_t>(&slots[target]);
+            llvm::Type* slot_ty = fn->getType()->getPointerTo();
+            llvm::Value* slot_ptr = irb.CreateIntToPtr(irb.getInt64(slot),
+                                                       slot_ty);
+            callee = irb.CreateLoad(slot_ptr);
+            auto* call_bb = llvm::BasicBlock::Create(ctx, "", fn, dispatch);
+            irb.CreateCondBr(irb.CreateIsNull(callee), dispatch, call_bb);
+            irb.SetInsertPoint(call_bb);
+        }
+        chain_call(irb, callee);
+        irb.CreateRetVoid();
+    };
+
+    for (llvm::ReturnInst* ret : rets) {
+        llvm::Value* rip = StoredRip(ret, sptr);
+        if (!rip)
+            continue;
+
+        // Unconditional jump to a known block: call the successor directly
+        // before the ret.
+        auto* const_rip = llvm::dyn_cast<llvm::ConstantInt>(rip);
+        if (const_rip) {
+            uint64_t target = const_rip->getZExtValue();
+            if (llvm::Value* callee = ChainTarget(fn, target)) {
+                llvm::IRBuilder<> irb(ret);
+                chain_call(irb, callee);
+                chain_preds[target].insert(block.start);
+                block.succs.push_back(target);
+                continue;
+            }
+        }
+
+        // Otherwise, compare with each constant target and fall back to
+        // returning to the dispatcher.
+        llvm::SmallVector<uint64_t, 2> targets;
+        auto add_target = [&] (llvm::Value* value) {
+            auto* const_val = llvm::dyn_cast<llvm::ConstantInt>(value);
+            if (!const_val)
+                return;
+            uint64_t target = const_val->getZExtValue();
+            if (std::find(targets.begin(), targets.end(), target) ==
+                targets.end())
+                targets.push_back(target);
+        };
+        // Both edges of a conditional branch may lead to the exit block, so
+        // the phi node has the select as incoming value.
+        auto add_select_target = [&] (llvm::Value* value) {
+            if (auto* select = llvm::dyn_cast<llvm::SelectInst>(value)) {
+                add_target(select->getTrueValue());
+                add_target(select->getFalseValue());
+            } else {
+                add_target(value);
+            }
+        };
+        if (auto* phi = llvm::dyn_cast<llvm::PHINode>(rip)) {
+            for (llvm::Value* incoming : phi->incoming_values())
+                add_select_target(incoming);
+        } else {
+            add_select_target(rip);
+        }
+        if (targets.empty())
+            continue;
+
+        llvm::BasicBlock* ret_bb = ret->getParent();
+        llvm::BasicBlock* dispatch = ret_bb->splitBasicBlock(ret);
+        ret_bb->getTerminator()->eraseFromParent();
+
+        llvm::IRBuilder<> irb(ret_bb);
+        for (uint64_t target : targets) {
+            auto* chain_bb = llvm::BasicBlock::Create(ctx, "", fn, dispatch);
+            if (const_rip) {
+                irb.CreateBr(chain_bb);
+            } else {
+                auto* next_bb = llvm::BasicBlock::Create(ctx, "", fn, dispatch);
+                irb.CreateCondBr(irb.CreateICmpEQ(rip, irb.getInt64(target)),
+                                 chain_bb, next_bb);
+                irb.SetInsertPoint(next_bb);
+            }
+            chain_block(chain_bb, target, dispatch);
+        }
+        if (!const_rip)
+            irb.CreateBr(dispatch);
+    }
+}
+
+bool BlockCache::Flush() {
+    if (pending.empty())
+        return true;
+
+    std::vector<LLVMValueRef> fns;
+    for (uint64_t addr : pending) {
+        Block& block = blocks[addr];
+        Chain(block);
+        fns.push_back(llvm::wrap(block.fn));
+    }
+
+    // The module is owned by the embedder from now on.
+    std::vector<void*> code(pending.size());
+    compile(llvm::wrap(batch.release()), pending.size(), fns.data(),
+            code.data(), user_arg);
+
+    std::vector<uint64_t> failed;
+    for (size_t i = 0; i < pending.size(); i++) {
+        Block& block = blocks[pending[i]];
+        block.fn = nullptr;
+        block.code = code[i];
+        if (!code[i])
+            failed.push_back(pending[i]);
+        else if (auto slot = slots.find(pending[i]); slot != slots.end())
+            slot->second = code[i];
+    }
+    pending.clear();
+
+    for (uint64_t addr : failed)
+        Drop(addr);
+    return failed.empty();
+}
+
+void BlockCache::Drop(uint64_t addr) {
+    auto it = blocks.find(addr);
+    if (it == blocks.end())
+        return;
+
+    if (it->second.fn) {
+        // Pending blocks are not chained yet, so nothing refers to them.
+        it->second.fn->eraseFromParent();
+        pending.erase(std::find(pending.begin(), pending.end(), addr));
+    }
+    for (uint64_t succ : it->second.succs)
+        chain_preds[succ].erase(addr);
+    blocks.erase(it);
+    // Blocks chained through the slot return to the dispatcher again.
+    if (auto slot = slots.find(addr); slot != slots.end())
+        slot->second = nullptr;
+
+    // Blocks chained to this one contain its address, drop them as well.
+    auto preds_it = chain_preds.find(addr);
+    if (preds_it == chain_preds.end())
+        return;
+    std::unordered_set<uint64_t> preds = std::move(preds_it->second);
+    chain_preds.erase(preds_it);
+    for (uint64_t pred : preds)
+        Drop(pred);
+}
+
+void BlockCache::Invalidate(uint64_t start, uint64_t end) {
+    std::vector<uint64_t> stale;
+    for (const auto& item : blocks)
+        if (item.second.start < end && start < item.second.end)
+            stale.push_back(item.first);
+    for (uint64_t addr : stale)
+        Drop(addr);
+}
+
+} // namespace rellume
@@ -0,0 +1,100 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#ifndef LL_BLOCKCACHE_H
+#define LL_BLOCKCACHE_H
+
+#include "rellume/rellume.h"
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+namespace rellume {
+
+struct LLConfig;
+
+/// Cache of single basic blocks lifted for dynamic binary translation. Blocks
+/// are lifted into a shared batch module, which is handed to the embedder for
+/// compilation in one go. Blocks ending with a jump to a known address are
+/// chained to the successor with a tail call, bypassing the dispatcher. If the
+/// successor is not lifted yet, the call goes through a slot of the cache,
+/// which is filled when the successor is compiled; compiled code must not be
+/// used after the cache is disposed.
+class BlockCache {
+public:
+    BlockCache(LLConfig* cfg, llvm::LLVMContext& ctx,
+               LLBlockCacheCompileCb compile, void* user_arg)
+        : cfg(cfg), ctx(ctx), compile(compile), user_arg(user_arg) {}
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    /// Host code of the block at addr, or null if it is not compiled yet.
+    void* Lookup(uint64_t addr) const;
+    /// Lift the block at addr into the current batch. Returns false if the
+    /// block could not be lifted.
+    bool Add(uint64_t addr, RellumeMemAccessCb memacc, void* memacc_arg);
+    /// Compile all blocks of the current batch.
+    bool Flush();
+    /// Drop all blocks overlapping [start, end) and all blocks chained to them.
+    void Invalidate(uint64_t start, uint64_t end);
+
+private:
+    struct Block {
+        uint64_t start;
+        uint64_t end;
+        /// Lifted function while the block is pending, null afterwards.
+        llvm::Function* fn;
+        void* code;
+        /// Blocks to which this block is chained.
+        std::vector<uint64_t> succs;
+    };
+
+    llvm::Value* ChainTarget(llvm::Function* fn, uint64_t addr);
+    void Chain(Block& block);
+    void Drop(uint64_t addr);
+
+    LLConfig* cfg;
+    llvm::LLVMContext& ctx;
+    LLBlockCacheCompileCb compile;
+    void* user_arg;
+
+    std::unique_ptr<llvm::Module> batch;
+    std::vector<uint64_t> pending;
+    std::unordered_map<uint64_t, Block> blocks;
+    /// Blocks which are chained directly to the key block.
+    std::unordered_map<uint64_t, std::unordered_set<uint64_t>> chain_preds;
+    /// Code of the key block for chaining through memory, null if the block
+    /// is not compiled. Elements are never removed, so their address is fixed.
+    std::unordered_map<uint64_t, void*> slots;
+};
+
+} // namespace rellume
+
+#endif
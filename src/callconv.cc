@@ -34,10 +34,23 @@
 
 namespace rellume {
 
+// Type of vector registers passed in host registers.
+static llvm::Type* RegcallVecType(llvm::LLVMContext& ctx) {
+    llvm::Type* ivec_ty = Facet{Facet::IVEC}.Type(ctx);
+    unsigned num = ivec_ty->getIntegerBitWidth() / 64;
+    return llvm::VectorType::get(llvm::Type::getInt64Ty(ctx), num);
+}
+
 CallConv CallConv::FromFunction(llvm::Function* fn) {
     auto fn_cconv = fn->getCallingConv();
     auto fn_ty = llvm::cast<llvm::FunctionType>(fn->getType()->getPointerElementType());
-    CallConv hunch = fn_cconv == llvm::CallingConv::HHVM ? HHVM : SPTR;
+    CallConv hunch = SPTR;
+    if (fn_cconv == llvm::CallingConv::HHVM)
+        hunch = HHVM;
+    else if (fn_cconv == llvm::CallingConv::X86_RegCall)
+        hunch = CallConv(REGCALL, fn->arg_size() - 11);
+    if (hunch == REGCALL && (fn->arg_size() < 11 || hunch.VecRegs() > 16))
+        return INVALID;
 
     // Verify hunch.
     if (hunch.FnCallConv() != fn_cconv)
@@ -72,6 +85,16 @@ llvm::FunctionType* CallConv::FnType(llvm::LLVMContext& ctx,
                                                 i64, i64, i64, i64, i64, i64,
                                                 i64, i64}, false);
     }
+    case CallConv::REGCALL: {
+        // RIP, packed flags, 8 GP registers, then the vector registers.
+        llvm::Type* vec_ty = RegcallVecType(ctx);
+        llvm::SmallVector<llvm::Type*, 26> ret_tys(10, i64);
+        ret_tys.append(vec_regs, vec_ty);
+        llvm::SmallVector<llvm::Type*, 27> param_tys{i8p};
+        param_tys.append(ret_tys.begin(), ret_tys.end());
+        auto ret_ty = llvm::StructType::get(ctx, ret_tys);
+        return llvm::FunctionType::get(ret_ty, param_tys, false);
+    }
     }
 }
 
@@ -80,6 +103,7 @@ llvm::CallingConv::ID CallConv::FnCallConv() const {
     default: return llvm::CallingConv::C;
     case CallConv::SPTR: return llvm::CallingConv::C;
     case CallConv::HHVM: return llvm::CallingConv::HHVM;
+    case CallConv::REGCALL: return llvm::CallingConv::X86_RegCall;
     }
 }
 
@@ -88,6 +112,7 @@ unsigned CallConv::CpuStructParamIdx() const {
     default: return 0;
     case CallConv::SPTR: return 0;
     case CallConv::HHVM: return 1;
+    case CallConv::REGCALL: return 0;
     }
 }
 
@@ -115,8 +140,61 @@ static uint8_t hhvm_ret_index(X86Reg reg) {
     return (reg.IsGP() && reg.Index() < 12) ? indices[reg.Index()] : 0;
 }
 
+// Mapping for REGCALL to return struct indices, parameter indices are shifted
+// by one for the CPU struct pointer:
+//     RIP->0; flags->1; RAX..RDI->2..9; XMM0..->10..
+static bool regcall_is_host_reg(CallConv cconv, X86Reg reg) {
+    switch (reg.Kind()) {
+    case X86Reg::RegKind::IP: return true;
+    case X86Reg::RegKind::EFLAGS: return true;
+    case X86Reg::RegKind::GP: return reg.Index() < 8;
+    case X86Reg::RegKind::VEC: return reg.Index() < cconv.VecRegs();
+    default: return false;
+    }
+}
+static unsigned regcall_ret_index(X86Reg reg) {
+    switch (reg.Kind()) {
+    case X86Reg::RegKind::IP: return 0;
+    case X86Reg::RegKind::EFLAGS: return 1;
+    case X86Reg::RegKind::GP: return 2 + reg.Index();
+    case X86Reg::RegKind::VEC: return 10 + reg.Index();
+    default: assert(false && "invalid register for regcall"); return 0;
+    }
+}
+// Position of flags in the packed value, same as in RFLAGS.
+static unsigned regcall_flag_bit(Facet facet) {
+    switch (facet) {
+    case Facet::CF: return 0;
+    case Facet::PF: return 2;
+    case Facet::AF: return 4;
+    case Facet::ZF: return 6;
+    case Facet::SF: return 7;
+    case Facet::DF: return 10;
+    case Facet::OF: return 11;
+    default: assert(false && "invalid flag facet"); return 0;
+    }
+}
+
+static bool is_host_reg(CallConv cconv, X86Reg reg) {
+    if (cconv == CallConv::HHVM)
+        return hhvm_is_host_reg(reg);
+    if (cconv == CallConv::REGCALL)
+        return regcall_is_host_reg(cconv, reg);
+    return false;
+}
+static unsigned arg_index(CallConv cconv, X86Reg reg) {
+    if (cconv == CallConv::REGCALL)
+        return regcall_ret_index(reg) + 1;
+    return hhvm_arg_index(reg);
+}
+static unsigned ret_index(CallConv cconv, X86Reg reg) {
+    if (cconv == CallConv::REGCALL)
+        return regcall_ret_index(reg);
+    return hhvm_ret_index(reg);
+}
+
 template<typename F>
-static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
+static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F host_fn) {
     RegFile& regfile = *bb->GetRegFile();
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
@@ -124,11 +202,22 @@ static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
     pack_info.block_dirty_regs = regfile.DirtyRegs();
     pack_info.bb = bb;
 
+    llvm::Value* packed_flags = nullptr;
     for (const auto& [sptr_idx, reg, facet] : cpu_struct_entries) {
         llvm::Value* reg_val = regfile.GetReg(reg, facet);
 
-        if (cconv == CallConv::HHVM && hhvm_is_host_reg(reg)) {
-            hhvm_fn(reg, reg_val);
+        if (is_host_reg(cconv, reg)) {
+            if (reg.Kind() == X86Reg::RegKind::EFLAGS) {
+                llvm::Value* flag = irb.CreateZExt(reg_val, irb.getInt64Ty());
+                flag = irb.CreateShl(flag, regcall_flag_bit(facet));
+                packed_flags = packed_flags ? irb.CreateOr(packed_flags, flag)
+                                            : flag;
+            } else if (reg.Kind() == X86Reg::RegKind::VEC) {
+                llvm::Type* vec_ty = RegcallVecType(irb.getContext());
+                host_fn(reg, irb.CreateBitCast(reg_val, vec_ty));
+            } else {
+                host_fn(reg, reg_val);
+            }
             continue;
         }
 
@@ -137,24 +226,35 @@ static void Pack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
         regfile.CleanedRegs()[regset_idx] = true;
         pack_info.stores[sptr_idx] = irb.CreateStore(reg_val, fi.sptr[sptr_idx]);
     }
+
+    if (packed_flags)
+        host_fn(X86Reg::EFLAGS, packed_flags);
 }
 
 template<typename F>
-static void Unpack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn) {
+static void Unpack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F host_fn) {
     RegFile& regfile = *bb->GetRegFile();
     llvm::IRBuilder<> irb(regfile.GetInsertBlock());
 
     // Clear all facets before entering new values.
     regfile.Clear();
     for (const auto& [sptr_idx, reg, facet] : cpu_struct_entries) {
-        if (cconv == CallConv::HHVM && hhvm_is_host_reg(reg)) {
-            regfile.SetReg(reg, facet, hhvm_fn(reg), false);
+        if (is_host_reg(cconv, reg)) {
+            llvm::Value* reg_val = host_fn(reg);
+            if (reg.Kind() == X86Reg::RegKind::EFLAGS) {
+                reg_val = irb.CreateLShr(reg_val, regcall_flag_bit(facet));
+                reg_val = irb.CreateTrunc(reg_val, irb.getInt1Ty());
+            } else if (reg.Kind() == X86Reg::RegKind::VEC) {
+                llvm::Type* ivec_ty = facet.Type(irb.getContext());
+                reg_val = irb.CreateBitCast(reg_val, ivec_ty);
+            }
+            regfile.SetReg(reg, facet, reg_val, false);
             continue;
         }
 
-        llvm::Value* reg_val = irb.CreateLoad(fi.sptr[sptr_idx]);
-        // Mark register as clean if it was loaded from the sptr.
-        regfile.SetReg(reg, facet, reg_val, false);
+        // Load registers only when they are actually used. Mark register as
+        // clean, as its value is the one in the sptr.
+        regfile.SetRegLoad(reg, facet, fi.sptr[sptr_idx]);
         regfile.DirtyRegs()[RegisterSetBitIdx(reg, facet)] = false;
     }
 }
@@ -162,24 +262,28 @@ static void Unpack(CallConv cconv, BasicBlock* bb, FunctionInfo& fi, F hhvm_fn)
 llvm::ReturnInst* CallConv::Return(BasicBlock* bb, FunctionInfo& fi) const {
     llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
 
-    llvm::SmallVector<llvm::Value*, 16> hhvm_ret;
+    llvm::SmallVector<llvm::Value*, 16> host_ret;
     if (*this == CallConv::HHVM) {
-        hhvm_ret.resize(14);
-        hhvm_ret[12] = llvm::UndefValue::get(irb.getInt64Ty());
+        host_ret.resize(14);
+        host_ret[12] = llvm::UndefValue::get(irb.getInt64Ty());
+    } else if (*this == CallConv::REGCALL) {
+        host_ret.resize(10 + vec_regs);
     }
 
-    Pack(*this, bb, fi, [&hhvm_ret] (X86Reg reg, llvm::Value* reg_val) {
-        hhvm_ret[hhvm_ret_index(reg)] = reg_val;
+    CallConv cconv = *this;
+    Pack(*this, bb, fi, [&] (X86Reg reg, llvm::Value* reg_val) {
+        host_ret[ret_index(cconv, reg)] = reg_val;
     });
 
-    if (*this == CallConv::HHVM)
-        return irb.CreateAggregateRet(hhvm_ret.data(), hhvm_ret.size());
+    if (!host_ret.empty())
+        return irb.CreateAggregateRet(host_ret.data(), host_ret.size());
     return irb.CreateRetVoid();
 }
 
 void CallConv::UnpackParams(BasicBlock* bb, FunctionInfo& fi) const {
-    Unpack(*this, bb, fi, [&fi] (X86Reg reg) {
-        return &fi.fn->arg_begin()[hhvm_arg_index(reg)];
+    CallConv cconv = *this;
+    Unpack(*this, bb, fi, [&] (X86Reg reg) {
+        return &fi.fn->arg_begin()[arg_index(cconv, reg)];
     });
 }
 
@@ -189,8 +293,9 @@ llvm::CallInst* CallConv::Call(llvm::Function* fn, BasicBlock* bb,
     call_args.resize(fn->arg_size());
     call_args[CpuStructParamIdx()] = fi.sptr_raw;
 
-    Pack(*this, bb, fi, [&call_args] (X86Reg reg, llvm::Value* reg_val) {
-        call_args[hhvm_arg_index(reg)] = reg_val;
+    CallConv cconv = *this;
+    Pack(*this, bb, fi, [&] (X86Reg reg, llvm::Value* reg_val) {
+        call_args[arg_index(cconv, reg)] = reg_val;
     });
 
     llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
@@ -208,19 +313,32 @@ llvm::CallInst* CallConv::Call(llvm::Function* fn, BasicBlock* bb,
         return call;
     }
 
-    llvm::SmallVector<llvm::Value*, 14> hhvm_ret;
-    if (*this == CallConv::HHVM) {
-        for (unsigned i = 0; i < 14; i++)
-            hhvm_ret.push_back(irb.CreateExtractValue(call, {i}));
+    llvm::SmallVector<llvm::Value*, 16> host_ret;
+    if (auto ret_ty = llvm::dyn_cast<llvm::StructType>(call->getType())) {
+        for (unsigned i = 0; i < ret_ty->getNumElements(); i++)
+            host_ret.push_back(irb.CreateExtractValue(call, {i}));
     }
 
-    Unpack(*this, bb, fi, [&hhvm_ret] (X86Reg reg) {
-        return hhvm_ret[hhvm_ret_index(reg)];
+    Unpack(*this, bb, fi, [&] (X86Reg reg) {
+        return host_ret[ret_index(cconv, reg)];
     });
 
     return call;
 }
 
+llvm::CallInst* CallConv::CallInspect(llvm::Function* fn,
+                                      llvm::ArrayRef<llvm::Value*> args,
+                                      BasicBlock* bb, FunctionInfo& fi) {
+    Pack(CallConv::SPTR, bb, fi, [] (X86Reg reg, llvm::Value* reg_val) {});
+
+    llvm::SmallVector<llvm::Value*, 4> call_args;
+    call_args.push_back(fi.sptr_raw);
+    call_args.append(args.begin(), args.end());
+
+    llvm::IRBuilder<> irb(bb->GetRegFile()->GetInsertBlock());
+    return irb.CreateCall(fn->getFunctionType(), fn, call_args);
+}
+
 void CallConv::OptimizePacks(FunctionInfo& fi, BasicBlock* entry) {
     // Map of basic block to dirty register at (beginning, end) of the block.
     llvm::DenseMap<BasicBlock*, std::pair<RegisterSet, RegisterSet>> bb_map;
@@ -260,14 +378,93 @@ void CallConv::OptimizePacks(FunctionInfo& fi, BasicBlock* entry) {
         queue_vec = std::move(new_queue_vec);
     }
 
-    for (const auto& pack : fi.call_conv_packs) {
+    for (auto& pack : fi.call_conv_packs) {
         RegisterSet regset = bb_map.lookup(pack.bb).first | pack.block_dirty_regs;
         for (const auto& [sptr_idx, reg, facet] : cpu_struct_entries) {
             if (pack.stores[sptr_idx] && !regset[RegisterSetBitIdx(reg, facet)]) {
                 pack.stores[sptr_idx]->eraseFromParent();
+                pack.stores[sptr_idx] = nullptr;
             }
         }
     }
 }
 
+void CallConv::MergeReturns(FunctionInfo& fi) {
+    // Find packs directly before a return; only the last pack of a block can
+    // be one, earlier packs belong to calls.
+    llvm::SmallVector<CallConvPack*, 8> ret_packs;
+    llvm::SmallPtrSet<llvm::BasicBlock*, 8> seen_blocks;
+    for (auto it = fi.call_conv_packs.rbegin();
+         it != fi.call_conv_packs.rend(); ++it) {
+        llvm::BasicBlock* llvm_block = it->bb->GetRegFile()->GetInsertBlock();
+        if (!seen_blocks.insert(llvm_block).second)
+            continue;
+        auto ret = llvm::dyn_cast<llvm::ReturnInst>(llvm_block->getTerminator());
+        if (!ret)
+            continue;
+        // Tail calls must remain directly before their return.
+        auto call = llvm::dyn_cast_or_null<llvm::CallInst>(ret->getPrevNode());
+        if (call && call->isMustTailCall())
+            continue;
+        ret_packs.push_back(&*it);
+    }
+    if (ret_packs.size() < 2)
+        return;
+
+    llvm::BasicBlock* ret_block =
+        llvm::BasicBlock::Create(fi.fn->getContext(), "", fi.fn);
+    llvm::IRBuilder<> irb(ret_block);
+
+    // PHIs for stores to the sptr which are common to all returns. Stores
+    // after the last call are only followed by other pack instructions, which
+    // don't access the same memory, so they can be sunk.
+    llvm::SmallVector<std::pair<llvm::PHINode*, llvm::Value*>, 32> sunk_stores;
+    for (unsigned i = 0; i < SptrIdx::MAX; i++) {
+        bool common = true;
+        for (CallConvPack* pack : ret_packs)
+            common &= pack->stores[i] != nullptr;
+        if (!common)
+            continue;
+
+        llvm::Type* ty = ret_packs[0]->stores[i]->getValueOperand()->getType();
+        llvm::PHINode* phi = irb.CreatePHI(ty, ret_packs.size());
+        for (CallConvPack* pack : ret_packs) {
+            llvm::StoreInst* store = pack->stores[i];
+            phi->addIncoming(store->getValueOperand(), store->getParent());
+            store->eraseFromParent();
+            pack->stores[i] = nullptr;
+        }
+        sunk_stores.push_back(std::make_pair(phi, fi.sptr[i]));
+    }
+
+    llvm::PHINode* ret_phi = nullptr;
+    llvm::Type* ret_ty = fi.fn->getReturnType();
+    if (!ret_ty->isVoidTy())
+        ret_phi = irb.CreatePHI(ret_ty, ret_packs.size());
+    for (CallConvPack* pack : ret_packs) {
+        llvm::BasicBlock* llvm_block = pack->bb->GetRegFile()->GetInsertBlock();
+        auto ret = llvm::cast<llvm::ReturnInst>(llvm_block->getTerminator());
+        if (ret_phi)
+            ret_phi->addIncoming(ret->getReturnValue(), llvm_block);
+        ret->eraseFromParent();
+        llvm::BranchInst::Create(ret_block, llvm_block);
+    }
+
+    for (const auto& [phi, ptr] : sunk_stores) {
+        llvm::Value* value = phi;
+        // Don't keep PHIs where all returns store the same value.
+        if (llvm::Value* same_value = phi->hasConstantValue()) {
+            phi->replaceAllUsesWith(same_value);
+            phi->eraseFromParent();
+            value = same_value;
+        }
+        irb.CreateStore(value, ptr);
+    }
+
+    if (ret_phi)
+        irb.CreateRet(ret_phi);
+    else
+        irb.CreateRetVoid();
+}
+
 } // namespace
@@ -27,6 +27,7 @@
 #include "basicblock.h"
 #include "regfile.h"
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <cstddef>
@@ -40,7 +41,7 @@ class FunctionInfo;
 class CallConv {
 public:
     enum Value {
-        INVALID, SPTR, HHVM,
+        INVALID, SPTR, HHVM, REGCALL,
     };
 
     static CallConv FromFunction(llvm::Function* fn);
@@ -59,15 +60,29 @@ public:
 
     llvm::CallInst* Call(llvm::Function* fn, BasicBlock* bb, FunctionInfo& fi,
                          bool tail_call = false);
+    // Store the register file into the CPU struct and call fn with the CPU
+    // struct pointer followed by args. The callee must not modify the CPU
+    // state, the register file is kept as is.
+    static llvm::CallInst* CallInspect(llvm::Function* fn,
+                                       llvm::ArrayRef<llvm::Value*> args,
+                                       BasicBlock* bb, FunctionInfo& fi);
 
     static void OptimizePacks(FunctionInfo& fi, BasicBlock* entry);
+    // Route all returns through a single block, sinking the stores to the CPU
+    // struct which are common to all of them.
+    static void MergeReturns(FunctionInfo& fi);
+
+    /// For REGCALL, the number of vector registers passed in host registers.
+    unsigned VecRegs() const { return vec_regs; }
 
     CallConv() = default;
-    constexpr CallConv(Value value) : value(value) {}
+    constexpr CallConv(Value value, unsigned vec_regs = 0)
+        : value(value), vec_regs(vec_regs) {}
     operator Value() const { return value; }
     explicit operator bool() = delete;
 private:
     Value value;
+    unsigned vec_regs;
 };
 
 } // namespace
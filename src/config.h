@@ -39,25 +39,55 @@ namespace rellume {
 
 struct LLConfig {
     /// Enable the usage of overflow intrinsics instead of bitwise operations
-    /// when setting the overflow flag. For dynamic values this leads to better
-    /// code which relies on the overflow flag again. However, immediate values
-    /// are not folded when they are guaranteed to (not) overflow.
+    /// and comparisons when setting the overflow and carry flag of additions,
+    /// subtractions (incl. CMP, NEG, INC, DEC) and multiplications. For
+    /// dynamic values this leads to better code which relies on the flags
+    /// again. However, immediate values are not folded when they are
+    /// guaranteed to (not) overflow.
     bool enableOverflowIntrinsics = false;
     /// Unsafe floating-point optimizations, corresponds to -ffast-math.
     bool enableFastMath = false;
+    /// Compute x87 instructions in double precision instead of x86_fp80. The
+    /// registers are still stored with 80 bits in the CPU struct, but results
+    /// are rounded to double precision and range after every instruction.
+    bool x87_double = false;
     /// Make CALL and RET clobber all status flags.
     bool call_ret_clobber_flags = false;
     /// Use native registers FS and GS for segmented memory access
     bool use_native_segment_base = false;
     /// Generate PHI nodes for all facets (instead of only one per register)
     bool full_facets = false;
+    /// Generate PHI nodes for other facets than the native one only when a
+    /// block reads that facet before writing the register. Predecessors which
+    /// have the facet pass it directly, others derive it from the native facet.
+    /// Ignored when full_facets is set.
+    bool adaptive_facets = false;
+    /// Lower REPNE SCASB to memchr/strlen and REPE CMPS of up to 4 KiB to
+    /// memcmp when the direction flag is known to be clear. The lifted code
+    /// then depends on these functions of the C library. memcmp may read the
+    /// whole range beyond the first difference, which the guest doesn't. Not
+    /// used with sandbox_base or tlb.
+    bool string_libcalls = false;
+    /// Emit an llvm.experimental.stackmap with the instruction address as ID
+    /// before the first guest memory access of an instruction. Together with
+    /// ll_stackmap_lookup, this maps a faulting host PC to the guest RIP
+    /// without the overhead of an instr_marker call for every instruction.
+    /// Records are opaque calls: memory accesses are not combined or moved
+    /// across them, so expect slower code for memory-heavy functions.
+    bool rip_stackmaps = false;
+    /// Assume that the lifted code is entered like a function in the SysV ABI,
+    /// i.e. RSP + 8 is 16-byte aligned, and raise the alignment of memory
+    /// accesses relative to the stack pointer accordingly.
+    bool abi_stack_alignment = false;
     /// Verify the IR after lifting.
     bool verify_ir = false;
     /// Don't use absolute instruction addresses to set RIP. The actual RIP is
     /// supplied as in the RIP register field of the CPU struct.
     bool position_independent_code = false;
 
-    /// Optimize generated IR for the HHVM calling convention.
+    /// Calling convention of the lifted function. HHVM passes RIP and 12 GP
+    /// registers in host registers; REGCALL passes RIP, RAX-RDI, the flags
+    /// packed into one i64 and the first VecRegs() vector registers.
     CallConv callconv = CallConv::SPTR;
     /// Address space for CPU struct pointer parameter
     unsigned sptr_addrspace = 0;
@@ -68,10 +98,44 @@ struct LLConfig {
     /// globalOffsetBase.
     llvm::Value* global_base_value = nullptr;
 
+    /// Base of the guest address space in host memory. If non-null, all
+    /// guest memory accesses go to sandbox_base + (address & sandbox_mask),
+    /// so that lifted code can only access this region. Accesses may exceed
+    /// the end of the region by up to 512 bytes, which should be covered by a
+    /// guard page. Disables global_base_value and use_native_segment_base.
+    llvm::Value* sandbox_base = nullptr;
+    /// Mask applied to guest addresses when sandboxing is enabled.
+    uint64_t sandbox_mask = UINT64_MAX;
+
+    /// Software TLB used to translate all guest memory accesses, takes
+    /// precedence over sandbox_base. This points to a direct-mapped table of
+    /// 2^tlb_bits entries of {uint64_t tag, uint64_t addend}, indexed by the
+    /// guest page number. On a hit, i.e. the tag equals the page number, the
+    /// host address is guest address + addend. Otherwise, tlb_miss_function
+    /// is called with the CPU state pointer and the guest address and returns
+    /// the host address, typically after filling the entry. The CPU state is
+    /// stored before the call, but RIP points after the current instruction
+    /// and other registers may already be partially updated by it; the miss
+    /// function must not modify the CPU state. Invalid entries should have the
+    /// tag -1. Accesses crossing a page boundary must be mapped contiguously.
+    llvm::Value* tlb = nullptr;
+    llvm::Function* tlb_miss_function = nullptr;
+    unsigned tlb_bits = 8;
+    unsigned tlb_page_bits = 12;
+
     /// Overridden implementations for specific instruction. The function must
     /// take a pointer to the CPU state as a single argument.
     std::unordered_map<uint32_t, llvm::Function*> instr_overrides;
 
+    /// Native implementations for direct calls to specific guest addresses,
+    /// e.g. of library functions like memcpy or malloc. The function is called
+    /// using the SysV calling convention with arguments from the registers,
+    /// the result is written back to RAX or XMM0. Only integer, pointer, float
+    /// and double parameters passed in registers are supported; pointer
+    /// parameters not with sandbox_base or tlb. Variadic functions are not
+    /// supported.
+    std::unordered_map<uint64_t, llvm::Function*> native_calls;
+
     /// If non-null, this function is called as a tail-call instead of
     /// returning.
     llvm::Function* tail_function = nullptr;
@@ -83,6 +147,19 @@ struct LLConfig {
     /// tail_function.
     llvm::Function* call_function = nullptr;
 
+    /// In call_function mode, assume that calls and returns are paired and
+    /// continue directly after a call. The pairing is verified on return with
+    /// a shadow stack of return addresses: this is a pointer to a variable
+    /// holding the top of the downwards-growing shadow stack of 64-bit return
+    /// addresses. Calls push, returns pop; the embedder must push the return
+    /// address of the outermost call. If call_function continues elsewhere
+    /// than after the call, this is handled like a mismatch on return.
+    llvm::Value* shadow_ret_stack = nullptr;
+    /// Function called when a return address doesn't match the shadow stack,
+    /// taking a pointer to the CPU state with RIP set to the actual target.
+    /// It must not return, e.g. by using longjmp. If null, the code traps.
+    llvm::Function* shadow_ret_stack_mismatch = nullptr;
+
     /// Implementation of syscall semantics. If not specified, a syscall behaves
     /// as a no-op. The function must take a pointer to the CPU state as a
     /// single argument.
@@ -92,6 +169,19 @@ struct LLConfig {
     /// function takes the value of RIP (which points at the end of the
     /// instruction) and a metadata containing an MDString with the FdInstr.
     llvm::Function* instr_marker = nullptr;
+
+    /// AFL-style edge coverage. At the entry of every guest basic block, the
+    /// byte at coverage_map[cur ^ prev] is incremented, where cur is a hash of
+    /// the block address below 2^coverage_map_bits and prev is cur of the
+    /// previously executed block shifted right by one. If coverage_map points
+    /// to a pointer (like AFL's __afl_area_ptr), the map address is loaded
+    /// from it at runtime, so the map can live in a shared-memory segment
+    /// attached only at startup. coverage_prev_loc points to the i64 holding
+    /// prev; if null, a thread-local variable is added to the module.
+    /// coverage_map_bits is at most 32.
+    llvm::Value* coverage_map = nullptr;
+    llvm::Value* coverage_prev_loc = nullptr;
+    unsigned coverage_map_bits = 16;
 };
 
 } // namespace
@@ -57,6 +57,8 @@ Facet Facet::FromType(llvm::Type* type) {
         return F32;
     } else if (type->isDoubleTy()) {
         return F64;
+    } else if (type->isX86_FP80Ty()) {
+        return F80;
     } else {
         assert(false && "invalid type for facet");
         return MAX;
@@ -27,21 +27,29 @@
 #include "callconv.h"
 #include "config.h"
 #include "function-info.h"
+#include "instr.h"
 #include "lifter.h"
 #include "regfile.h"
+#include "transforms.h"
 #include <llvm/ADT/DepthFirstIterator.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalValue.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
+#include <map>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
 
 
 /**
@@ -53,22 +61,106 @@
 
 namespace rellume {
 
+// Size of the CPU struct, i.e. the end of its last entry.
+static constexpr std::size_t kCpuStructSize = std::max({
+#define RELLUME_NAMED_REG(name,nameu,sz,off) std::size_t{off + sz},
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_NAMED_REG
+});
+
 static llvm::Value* CreateSptr(FunctionInfo& fi, llvm::IRBuilder<> irb,
-                               size_t offset, size_t bits) {
+                               size_t offset, llvm::Type* type) {
     unsigned as = fi.sptr_raw->getType()->getPointerAddressSpace();
     llvm::Value* ptr = irb.CreateConstGEP1_64(fi.sptr_raw, offset);
-    return irb.CreatePointerCast(ptr, irb.getIntNTy(bits)->getPointerTo(as));
+    return irb.CreatePointerCast(ptr, type->getPointerTo(as));
 }
 
 static void CreateSptrs(FunctionInfo& fi, llvm::BasicBlock* llvm_block) {
     llvm::IRBuilder<> irb(llvm_block);
 
+    // Registers are accessed with the type of their facet, all other fields
+    // as integers of their size.
+    llvm::Type* types[SptrIdx::MAX] = {};
+#define RELLUME_MAPPED_REG(nameu,off,reg,facet) \
+    types[SptrIdx::nameu] = Facet{facet}.Type(irb.getContext());
+#include <rellume/cpustruct-private.inc>
+#undef RELLUME_MAPPED_REG
+
 #define RELLUME_NAMED_REG(name,nameu,sz,off) \
-    fi.sptr[SptrIdx::nameu] = CreateSptr(fi, irb, off, sz == 1 ? sz : sz * 8);
+    fi.sptr[SptrIdx::nameu] = CreateSptr(fi, irb, off, \
+            types[SptrIdx::nameu] ? types[SptrIdx::nameu] \
+                                  : irb.getIntNTy(sz == 1 ? sz : sz * 8));
 #include <rellume/cpustruct-private.inc>
 #undef RELLUME_NAMED_REG
 }
 
+static void EmitEdgeCoverage(const LLConfig& cfg, ArchBasicBlock& block,
+                             uint64_t addr) {
+    RegFile* regfile = block.GetInsertBlock()->GetRegFile();
+    llvm::IRBuilder<> irb(regfile->GetInsertBlock());
+    llvm::Module* mod = irb.GetInsertBlock()->getModule();
+    llvm::Type* i64 = irb.getInt64Ty();
+
+    // Same block hash as AFL's QEMU mode.
+    assert(cfg.coverage_map_bits <= 32 && "coverage map too large");
+    uint64_t map_mask = (uint64_t{1} << cfg.coverage_map_bits) - 1;
+    uint64_t cur_loc = ((addr >> 4) ^ (addr << 8)) & map_mask;
+
+    llvm::Value* prev_loc_ptr = cfg.coverage_prev_loc;
+    if (!prev_loc_ptr) {
+        const char* name = "rellume_cov_prev_loc";
+        prev_loc_ptr = mod->getGlobalVariable(name);
+        if (!prev_loc_ptr) {
+            prev_loc_ptr = new llvm::GlobalVariable(*mod, i64, false,
+                llvm::GlobalValue::LinkOnceODRLinkage, irb.getInt64(0), name,
+                nullptr, llvm::GlobalValue::GeneralDynamicTLSModel);
+        }
+    }
+    unsigned prev_as = prev_loc_ptr->getType()->getPointerAddressSpace();
+    prev_loc_ptr = irb.CreatePointerCast(prev_loc_ptr,
+                                         i64->getPointerTo(prev_as));
+
+    llvm::Value* map = cfg.coverage_map;
+    auto map_ty = llvm::cast<llvm::PointerType>(map->getType());
+    if (map_ty->getElementType()->isPointerTy())
+        map = irb.CreateLoad(map);
+    unsigned map_as = map->getType()->getPointerAddressSpace();
+    map = irb.CreatePointerCast(map, irb.getInt8PtrTy(map_as));
+
+    llvm::Value* prev_loc = irb.CreateLoad(prev_loc_ptr);
+    llvm::Value* counter_ptr = irb.CreateGEP(map, irb.CreateXor(prev_loc,
+                                                                cur_loc));
+    llvm::Value* counter = irb.CreateLoad(counter_ptr);
+    irb.CreateStore(irb.CreateAdd(counter, irb.getInt8(1)), counter_ptr);
+    irb.CreateStore(irb.getInt64(cur_loc >> 1), prev_loc_ptr);
+}
+
+static std::mutex global_unsupported_mutex;
+static UnsupportedHistogram global_unsupported;
+
+static void RecordUnsupported(UnsupportedHistogram& hist, const Instr& inst) {
+    auto entry = UnsupportedInstr{0, inst.start()};
+    hist.try_emplace(inst.type(), entry).first->second.count++;
+}
+
+UnsupportedHistogram GlobalUnsupportedInstrs() {
+    std::lock_guard<std::mutex> lock(global_unsupported_mutex);
+    return global_unsupported;
+}
+
+void ResetGlobalUnsupportedInstrs() {
+    std::lock_guard<std::mutex> lock(global_unsupported_mutex);
+    global_unsupported.clear();
+}
+
+static BasicBlock::Phis PhiMode(const LLConfig* cfg) {
+    if (cfg->full_facets)
+        return BasicBlock::Phis::ALL;
+    if (cfg->adaptive_facets)
+        return BasicBlock::Phis::ADAPTIVE;
+    return BasicBlock::Phis::NATIVE;
+}
+
 Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg), fi{}
 {
     llvm::LLVMContext& ctx = mod->getContext();
@@ -82,7 +174,7 @@ Function::Function(llvm::Module* mod, LLConfig* cfg) : cfg(cfg), fi{}
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoAlias);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::NoCapture);
     llvm->addParamAttr(cpu_param_idx, llvm::Attribute::getWithAlignment(ctx, 16));
-    llvm->addDereferenceableParamAttr(cpu_param_idx, 0x190);
+    llvm->addDereferenceableParamAttr(cpu_param_idx, kCpuStructSize);
 
     fi.fn = llvm;
     fi.sptr_raw = &llvm->arg_begin()[cpu_param_idx];
@@ -117,12 +209,31 @@ bool Function::AddInst(uint64_t block_addr, const Instr& inst)
         }
     }
     if (block_map.find(block_addr) == block_map.end()) {
-        auto phi_mode =
-            cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
-        block_map[block_addr] = std::make_unique<ArchBasicBlock>(llvm, phi_mode);
+        block_map[block_addr] =
+            std::make_unique<ArchBasicBlock>(llvm, PhiMode(cfg));
+        if (cfg->coverage_map)
+            EmitEdgeCoverage(*cfg, *block_map[block_addr], block_addr);
+    }
+
+    ArchBasicBlock& block = *block_map[block_addr];
+    if (LiftInstruction(inst, fi, *cfg, block))
+        return true;
+    // The block will leave the function at this instruction, which is usually
+    // a trap (HLT, UD2, INT3, INT) or something we can't handle anyway.
+    block.SetCold();
+
+    // Traps are left to the embedder by design, so don't count them.
+    switch (inst.type()) {
+    case FDI_HLT: case FDI_UD2: case FDI_INT3: case FDI_INT:
+        return false;
+    default:
+        break;
     }
 
-    return LiftInstruction(inst, fi, *cfg, *block_map[block_addr]);
+    RecordUnsupported(unsupported, inst);
+    std::lock_guard<std::mutex> lock(global_unsupported_mutex);
+    RecordUnsupported(global_unsupported, inst);
+    return false;
 }
 
 ArchBasicBlock& Function::ResolveAddr(llvm::Value* addr) {
@@ -149,9 +260,7 @@ llvm::Function* Function::Lift() {
     if (block_map.size() == 0)
         return nullptr;
 
-    auto phi_mode =
-        cfg->full_facets ? BasicBlock::Phis::ALL : BasicBlock::Phis::NATIVE;
-    exit_block = std::make_unique<ArchBasicBlock>(llvm, phi_mode);
+    exit_block = std::make_unique<ArchBasicBlock>(llvm, PhiMode(cfg));
 
     // Exit block packs values together and optionally returns something.
     if (cfg->tail_function) {
@@ -162,17 +271,35 @@ llvm::Function* Function::Lift() {
         cfg->callconv.Return(exit_block->GetInsertBlock(), fi);
     }
 
+    // Get the stack pointer before it is passed to any successor.
+    llvm::Value* entry_sp = nullptr;
+    if (cfg->abi_stack_alignment) {
+        RegFile* entry_regfile = entry_block->GetInsertBlock()->GetRegFile();
+        entry_sp = entry_regfile->GetReg(X86Reg::RSP, Facet::I64);
+    }
+
     entry_block->BranchTo(*block_map[fi.entry_ip]);
 
+    // Conditionally leaving the lifted code and entering cold blocks is
+    // unlikely, so keep these paths out of the way of hot loops.
+    auto is_cold = [this] (ArchBasicBlock& block) {
+        return &block == exit_block.get() || block.IsCold();
+    };
+
     for (auto it = block_map.begin(); it != block_map.end(); ++it) {
         RegFile* regfile = it->second->GetInsertBlock()->GetRegFile();
         if (regfile->GetInsertBlock()->getTerminator())
             continue;
         llvm::Value* next_rip = regfile->GetReg(X86Reg::IP, Facet::I64);
         if (auto select = llvm::dyn_cast<llvm::SelectInst>(next_rip)) {
-            it->second->BranchTo(select->getCondition(),
-                                 ResolveAddr(select->getTrueValue()),
-                                 ResolveAddr(select->getFalseValue()));
+            ArchBasicBlock& then = ResolveAddr(select->getTrueValue());
+            ArchBasicBlock& other = ResolveAddr(select->getFalseValue());
+            auto likely = BasicBlock::Likely::NONE;
+            if (is_cold(then) && !is_cold(other))
+                likely = BasicBlock::Likely::OTHER;
+            else if (!is_cold(then) && is_cold(other))
+                likely = BasicBlock::Likely::THEN;
+            it->second->BranchTo(select->getCondition(), then, other, likely);
         } else {
             it->second->BranchTo(ResolveAddr(next_rip));
         }
@@ -192,6 +319,8 @@ llvm::Function* Function::Lift() {
         changed |= exit_block->FillPhis();
     }
 
+    CallConv::MergeReturns(fi);
+
     // Remove calls to llvm.ssa_copy, which got inserted to avoid PHI nodes in
     // the register file.
     for (auto it = llvm::inst_begin(llvm), e = llvm::inst_end(llvm); it != e;) {
@@ -204,6 +333,12 @@ llvm::Function* Function::Lift() {
         inst->eraseFromParent();
     }
 
+    // Lay out the blocks in address order after the entry block; blocks not
+    // belonging to an instruction, e.g. for merged returns, stay at the end.
+    llvm::BasicBlock* layout_pos = entry_block->MoveAfter(&llvm->front());
+    for (auto& item : block_map)
+        layout_pos = item.second->MoveAfter(layout_pos);
+
     // Remove blocks without predecessors. This can happen if constants get
     // folded already during construction, e.g. xor eax,eax;test eax,eax;jz
 #if LL_LLVM_MAJOR >= 9
@@ -219,6 +354,8 @@ llvm::Function* Function::Lift() {
     llvm::DeleteDeadBlocks(dead_blocks);
 #endif
 
+    InferAlignment(llvm, entry_sp);
+
     if (cfg->verify_ir && llvm::verifyFunction(*(llvm), &llvm::errs()))
         return nullptr;
 
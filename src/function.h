@@ -25,11 +25,13 @@
 #define LL_FUNCTION_H
 
 #include "function-info.h"
+#include "rellume/rellume.h"
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Value.h>
 #include <cstdint>
-#include <functional>
-#include <unordered_map>
+#include <map>
+#include <memory>
 
 
 namespace rellume {
@@ -38,6 +40,19 @@ class ArchBasicBlock;
 class Instr;
 class LLConfig;
 
+/// Instructions which could not be lifted, keyed by instruction type, with the
+/// number of occurrences and the first address seen. Traps (HLT, UD2, INT3,
+/// INT) are not included.
+struct UnsupportedInstr {
+    uint64_t count;
+    uint64_t first_addr;
+};
+using UnsupportedHistogram = std::map<unsigned, UnsupportedInstr>;
+
+/// Histogram over all functions lifted in this process.
+UnsupportedHistogram GlobalUnsupportedInstrs();
+void ResetGlobalUnsupportedInstrs();
+
 class Function
 {
 public:
@@ -53,16 +68,24 @@ public:
     bool AddInst(uint64_t block_addr, const Instr& inst);
     llvm::Function* Lift();
 
+    const UnsupportedHistogram& UnsupportedInstrs() const {
+        return unsupported;
+    }
+
     // Implemented in lldecoder.cc
-    enum class DecodeStop {
-        INSTR,
-        BASICBLOCK,
-        ALL,
-    };
-    using MemReader = std::function<size_t(uintptr_t, uint8_t*, size_t)>;
-    int Decode(uintptr_t addr, DecodeStop stop, MemReader memacc = nullptr);
+    using DecodeStop = rellume::DecodeStop;
+    /// Decode using a memory access callback; if it is null, the code is read
+    /// directly from the host memory.
+    int Decode(uintptr_t addr, DecodeStop stop, RellumeMemAccessCb memacc,
+               void* user_arg);
+    /// Decode from a buffer containing the code at address code_addr.
+    int Decode(uintptr_t addr, DecodeStop stop, llvm::ArrayRef<uint8_t> code,
+               uintptr_t code_addr);
 
 private:
+    template<typename Reader>
+    int DecodeImpl(uintptr_t addr, DecodeStop stop, Reader& reader);
+
     ArchBasicBlock& ResolveAddr(llvm::Value* addr);
 
     LLConfig* cfg;
@@ -72,7 +95,11 @@ private:
     uint64_t entry_addr;
     std::unique_ptr<ArchBasicBlock> entry_block;
     std::unique_ptr<ArchBasicBlock> exit_block;
-    std::unordered_map<uint64_t,std::unique_ptr<ArchBasicBlock>> block_map;
+    /// Blocks ordered by address, so that iteration and therefore the emitted
+    /// IR is deterministic.
+    std::map<uint64_t,std::unique_ptr<ArchBasicBlock>> block_map;
+
+    UnsupportedHistogram unsupported;
 };
 
 }
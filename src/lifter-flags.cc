@@ -103,14 +103,19 @@ void LifterBase::FlagCalcAdd(llvm::Value* res, llvm::Value* lhs,
     SetFlag(Facet::SF, irb.CreateICmpSLT(res, zero));
     FlagCalcP(res);
     FlagCalcA(res, lhs, rhs);
-    if (!skip_carry)
-        SetFlag(Facet::CF, irb.CreateICmpULT(res, lhs));
 
     if (cfg.enableOverflowIntrinsics) {
+        if (!skip_carry) {
+            llvm::Intrinsic::ID id = llvm::Intrinsic::uadd_with_overflow;
+            llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
+            SetFlag(Facet::CF, irb.CreateExtractValue(packed, 1));
+        }
         llvm::Intrinsic::ID id = llvm::Intrinsic::sadd_with_overflow;
         llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
         SetFlag(Facet::OF, irb.CreateExtractValue(packed, 1));
     } else {
+        if (!skip_carry)
+            SetFlag(Facet::CF, irb.CreateICmpULT(res, lhs));
         llvm::Value* tmp1 = irb.CreateNot(irb.CreateXor(lhs, rhs));
         llvm::Value* tmp2 = irb.CreateAnd(tmp1, irb.CreateXor(res, lhs));
         SetFlag(Facet::OF, irb.CreateICmpSLT(tmp2, zero));
@@ -129,11 +134,22 @@ void LifterBase::FlagCalcSub(llvm::Value* res, llvm::Value* lhs,
     SetFlag(Facet::SF, sf);
     FlagCalcP(res);
     FlagCalcA(res, lhs, rhs);
-    if (!skip_carry)
-        SetFlag(Facet::CF, irb.CreateICmpULT(lhs, rhs));
 
-    // Set overflow flag using arithmetic comparisons
-    SetFlag(Facet::OF, irb.CreateICmpNE(sf, irb.CreateICmpSLT(lhs, rhs)));
+    if (cfg.enableOverflowIntrinsics) {
+        if (!skip_carry) {
+            llvm::Intrinsic::ID id = llvm::Intrinsic::usub_with_overflow;
+            llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
+            SetFlag(Facet::CF, irb.CreateExtractValue(packed, 1));
+        }
+        llvm::Intrinsic::ID id = llvm::Intrinsic::ssub_with_overflow;
+        llvm::Value* packed = irb.CreateBinaryIntrinsic(id, lhs, rhs);
+        SetFlag(Facet::OF, irb.CreateExtractValue(packed, 1));
+    } else {
+        if (!skip_carry)
+            SetFlag(Facet::CF, irb.CreateICmpULT(lhs, rhs));
+        // Set overflow flag using arithmetic comparisons
+        SetFlag(Facet::OF, irb.CreateICmpNE(sf, irb.CreateICmpSLT(lhs, rhs)));
+    }
 }
 
 } // namespace
@@ -60,8 +60,15 @@ void Lifter::LiftArith(const Instr& inst, bool sub) {
     auto arith_op = sub ? llvm::Instruction::Sub : llvm::Instruction::Add;
     llvm::Value* res = irb.CreateBinOp(arith_op, op1, op2);
 
-    if (inst.type() != FDI_CMP)
+    bool ptr_arith = (inst.type() == FDI_ADD || inst.type() == FDI_SUB) &&
+                     inst.op(0).is_reg() && inst.op(0).bits() == 64;
+    if (ptr_arith) {
+        X86Reg reg = MapReg(inst.op(0).reg());
+        llvm::Value* offset = sub ? irb.CreateNeg(op2) : op2;
+        OpStoreGpPtrAdd(reg, res, reg, offset);
+    } else if (inst.type() != FDI_CMP) {
         OpStoreGp(inst.op(0), res);
+    }
     if (inst.type() == FDI_XADD)
         OpStoreGp(inst.op(1), op1);
 
@@ -132,7 +139,13 @@ void Lifter::LiftIncDec(const Instr& inst) {
         res = irb.CreateSub(op1, op2);
         FlagCalcSub(res, op1, op2, /*skip_carry=*/true);
     }
-    OpStoreGp(inst.op(0), res);
+    if (inst.op(0).is_reg() && inst.op(0).bits() == 64) {
+        X86Reg reg = MapReg(inst.op(0).reg());
+        int64_t offset = inst.type() == FDI_INC ? 1 : -1;
+        OpStoreGpPtrAdd(reg, res, reg, irb.getInt64(offset));
+    } else {
+        OpStoreGp(inst.op(0), res);
+    }
 }
 
 void Lifter::LiftShift(const Instr& inst, llvm::Instruction::BinaryOps op) {
@@ -347,13 +360,21 @@ void Lifter::LiftLea(const Instr& inst) {
     // Compute as integer
     unsigned addrsz = inst.op(1).addrsz() * 8;
     Facet facet = Facet{Facet::I}.Resolve(addrsz);
-    llvm::Value* res = irb.getIntN(addrsz, inst.op(1).off());
-    if (inst.op(1).base())
-        res = irb.CreateAdd(res, GetReg(MapReg(inst.op(1).base()), facet));
+    llvm::Value* offset = irb.getIntN(addrsz, inst.op(1).off());
     if (inst.op(1).scale() != 0) {
-        llvm::Value* offset = GetReg(MapReg(inst.op(1).index()), facet);
-        offset = irb.CreateMul(offset, irb.getIntN(addrsz, inst.op(1).scale()));
-        res = irb.CreateAdd(res, offset);
+        llvm::Value* index = GetReg(MapReg(inst.op(1).index()), facet);
+        index = irb.CreateMul(index, irb.getIntN(addrsz, inst.op(1).scale()));
+        offset = irb.CreateAdd(offset, index);
+    }
+    llvm::Value* res = offset;
+    if (inst.op(1).base()) {
+        X86Reg base = MapReg(inst.op(1).base());
+        res = irb.CreateAdd(GetReg(base, facet), offset);
+        if (addrsz == 64 && inst.op(0).bits() == 64) {
+            // Keep the pointer facet if the base register holds a pointer.
+            OpStoreGpPtrAdd(MapReg(inst.op(0).reg()), res, base, offset);
+            return;
+        }
     }
 
     llvm::Type* op_type = irb.getIntNTy(inst.op(0).bits());
@@ -373,7 +394,7 @@ void Lifter::LiftXlat(const Instr& inst) {
     }
 
     llvm::Value* ptr = irb.CreateGEP(bx, irb.CreateZExt(al, irb.getInt32Ty()));
-    OpStoreGp(X86Reg::RAX, irb.CreateLoad(irb.getInt8Ty(), ptr));
+    OpStoreGp(X86Reg::RAX, irb.CreateLoad(irb.getInt8Ty(), HostPtr(ptr)));
 }
 
 void Lifter::LiftCmovcc(const Instr& inst, Condition cond) {
@@ -425,12 +446,14 @@ void Lifter::LiftBittest(const Instr& inst) {
     if (inst.op(0).is_reg()) {
         val = OpLoad(inst.op(0), Facet::I);
     } else { // LL_OP_MEM
-        addr = OpAddr(inst.op(0), irb.getIntNTy(op_size), inst.op(0).seg());
+        addr = OpAddr(inst.op(0), irb.getIntNTy(op_size), inst.op(0).seg(),
+                      /*host=*/false);
         // Immediate operands are truncated, register operands are sign-extended
         if (inst.op(1).is_reg()) {
             llvm::Value* off = irb.CreateAShr(index, __builtin_ctz(op_size));
             addr = irb.CreateGEP(addr, irb.CreateSExt(off, irb.getInt64Ty()));
         }
+        addr = HostPtr(addr);
         val = irb.CreateLoad(addr);
     }
 
@@ -521,6 +544,13 @@ void Lifter::LiftCall(const Instr& inst) {
         SetFlagUndef({Facet::OF, Facet::SF, Facet::ZF, Facet::AF, Facet::PF,
                       Facet::CF});
 
+    if (inst.op(0).is_pcrel()) {
+        auto native = cfg.native_calls.find(inst.end() + inst.op(0).pcrel());
+        if (native != cfg.native_calls.end() &&
+            LiftCallNative(inst, native->second))
+            return;
+    }
+
     // Force default data segment, 3e is notrack.
     llvm::Value* new_rip = OpLoad(inst.op(0), Facet::I, ALIGN_NONE, FD_REG_DS);
     llvm::Value* ret_addr = GetReg(X86Reg::IP, Facet::I64);
@@ -528,20 +558,118 @@ void Lifter::LiftCall(const Instr& inst) {
     SetReg(X86Reg::IP, Facet::I64, new_rip);
 
     if (cfg.call_function) {
+        if (cfg.shadow_ret_stack)
+            ShadowStackPush(ret_addr);
         CallExternalFunction(cfg.call_function);
-        // Note that is not possible to have a "no-evil-rets" optimization which
-        // would just continue execution: things like setjmp/longjmp and
-        // exceptions skip some return addresses by modifying the stack pointer.
-        // We will continue with the tail_function (if specified) and enlarge
-        // our shadow stack; and things will be slow. If someone uses such
-        // constructs often or on a critical path, they get what they deserve.
         llvm::Value* cont_addr = GetReg(X86Reg::IP, Facet::I64);
         llvm::Value* eq = irb.CreateICmpEQ(cont_addr, ret_addr);
-        // This allows for optimization of the common case (equality).
+        if (cfg.shadow_ret_stack) {
+            // Lifted code verifies the return address against the shadow
+            // stack on return already, so continue directly after the call.
+            // call_function is not necessarily lifted code, so any other
+            // target is handled as mismatch.
+            ShadowStackGuard(eq);
+            SetReg(X86Reg::IP, Facet::I64, ret_addr);
+            return;
+        }
+        // Without a shadow stack, it is not possible to have a "no-evil-rets"
+        // optimization which would just continue execution: things like
+        // setjmp/longjmp and exceptions skip some return addresses by modifying
+        // the stack pointer. We will continue with the tail_function (if
+        // specified) and enlarge our host stack; and things will be slow. If
+        // someone uses such constructs often or on a critical path, they get
+        // what they deserve.
+        // This allows for optimization of the common case (equality), the
+        // other case leaves the function and is considered cold.
         SetReg(X86Reg::IP, Facet::I64, irb.CreateSelect(eq, ret_addr, cont_addr));
     }
 }
 
+bool Lifter::LiftCallNative(const Instr& inst, llvm::Function* fn) {
+    static const X86Reg gp_arg_regs[] = {
+        X86Reg::RDI, X86Reg::RSI, X86Reg::RDX, X86Reg::RCX, X86Reg::GP(8),
+        X86Reg::GP(9),
+    };
+
+    // Check the signature before emitting anything, so that unsupported
+    // functions are lifted as normal call. Pointer arguments would give the
+    // callee access outside of the sandbox or across guest pages.
+    llvm::FunctionType* fn_ty = fn->getFunctionType();
+    // Variadic functions would need AL set to the number of vector registers
+    // and would only get the fixed parameters.
+    if (fn_ty->isVarArg())
+        return false;
+    unsigned gp_cnt = 0, vec_cnt = 0;
+    for (llvm::Type* param_ty : fn_ty->params()) {
+        if (param_ty->isIntegerTy() && param_ty->getIntegerBitWidth() <= 64)
+            gp_cnt++;
+        else if (param_ty->isPointerTy() && !HasGuestAddrSpace())
+            gp_cnt++;
+        else if (param_ty->isFloatTy() || param_ty->isDoubleTy())
+            vec_cnt++;
+        else
+            return false;
+    }
+    if (gp_cnt > 6 || vec_cnt > 8)
+        return false;
+
+    // Returned host pointers can't be translated back through a TLB.
+    llvm::Type* ret_ty = fn_ty->getReturnType();
+    if (ret_ty->isPointerTy() && cfg.tlb)
+        return false;
+    if (!ret_ty->isVoidTy() && !ret_ty->isPointerTy() &&
+        !ret_ty->isFloatTy() && !ret_ty->isDoubleTy() &&
+        !(ret_ty->isIntegerTy() && ret_ty->getIntegerBitWidth() <= 64))
+        return false;
+
+    llvm::SmallVector<llvm::Value*, 8> args;
+    gp_cnt = 0;
+    vec_cnt = 0;
+    for (llvm::Type* param_ty : fn_ty->params()) {
+        llvm::Value* arg;
+        if (param_ty->isPointerTy()) {
+            arg = HostPtr(GetReg(gp_arg_regs[gp_cnt++], Facet::PTR));
+            arg = irb.CreatePointerCast(arg, param_ty);
+        } else if (param_ty->isIntegerTy()) {
+            arg = GetReg(gp_arg_regs[gp_cnt++], Facet::I64);
+            arg = irb.CreateTruncOrBitCast(arg, param_ty);
+        } else {
+            X86Reg reg = X86Reg::VEC(vec_cnt++);
+            arg = GetReg(reg, param_ty->isFloatTy() ? Facet::F32 : Facet::F64);
+        }
+        args.push_back(arg);
+    }
+
+    llvm::CallInst* call = irb.CreateCall(fn_ty, fn, args);
+    call->setCallingConv(fn->getCallingConv());
+    call->setAttributes(fn->getAttributes());
+
+    // Upper bits of the return registers are undefined, clear them.
+    if (ret_ty->isPointerTy() && cfg.sandbox_base) {
+        // Map host pointers back into the guest address space.
+        llvm::Value* base = irb.CreatePtrToInt(cfg.sandbox_base,
+                                               irb.getInt64Ty());
+        llvm::Value* ret_int = irb.CreatePtrToInt(call, irb.getInt64Ty());
+        SetReg(X86Reg::RAX, Facet::I64, irb.CreateSub(ret_int, base));
+    } else if (ret_ty->isPointerTy()) {
+        SetRegPtr(X86Reg::RAX, call);
+    } else if (ret_ty->isIntegerTy()) {
+        SetReg(X86Reg::RAX, Facet::I64, irb.CreateZExt(call, irb.getInt64Ty()));
+    } else if (!ret_ty->isVoidTy()) {
+        unsigned num = 128 / ret_ty->getPrimitiveSizeInBits();
+        llvm::Type* vec_ty = llvm::VectorType::get(ret_ty, num);
+        llvm::Value* zero = llvm::Constant::getNullValue(vec_ty);
+        llvm::Value* vec = irb.CreateInsertElement(zero, call, 0ul);
+        llvm::Type* ivec_ty = Facet{Facet::IVEC}.Type(irb.getContext());
+        SetReg(X86Reg::VEC(0), Facet::IVEC, irb.CreateBitCast(vec, ivec_ty));
+        SetRegFacet(X86Reg::VEC(0), Facet::FromType(vec_ty), vec);
+        SetRegFacet(X86Reg::VEC(0), Facet::FromType(ret_ty), call);
+    }
+
+    // The return address was pushed and popped again, RSP and RIP remain.
+    return true;
+}
+
 void Lifter::LiftRet(const Instr& inst) {
     // TODO: support 16-bit address size override
     if (cfg.call_ret_clobber_flags)
@@ -558,12 +686,53 @@ void Lifter::LiftRet(const Instr& inst) {
     }
 
     if (cfg.call_function) {
+        if (cfg.shadow_ret_stack)
+            ShadowStackCheck(GetReg(X86Reg::IP, Facet::I64));
         // If we are in call-ret-lifting mode, forcefully return. Otherwise, we
         // might end up using tail_function, which we don't want here.
         ForceReturn();
     }
 }
 
+void LifterBase::ShadowStackPush(llvm::Value* ret_addr) {
+    llvm::Type* sp_ty = irb.getInt64Ty()->getPointerTo();
+    llvm::Value* sp_ptr = irb.CreatePointerCast(cfg.shadow_ret_stack,
+                                                sp_ty->getPointerTo());
+    llvm::Value* sp = irb.CreateConstGEP1_64(irb.CreateLoad(sp_ptr), -1);
+    irb.CreateStore(ret_addr, sp);
+    irb.CreateStore(sp, sp_ptr);
+}
+
+void LifterBase::ShadowStackCheck(llvm::Value* ret_addr) {
+    llvm::Type* sp_ty = irb.getInt64Ty()->getPointerTo();
+    llvm::Value* sp_ptr = irb.CreatePointerCast(cfg.shadow_ret_stack,
+                                                sp_ty->getPointerTo());
+    llvm::Value* sp = irb.CreateLoad(sp_ptr);
+    llvm::Value* expected = irb.CreateLoad(sp);
+    irb.CreateStore(irb.CreateConstGEP1_64(sp, 1), sp_ptr);
+
+    ShadowStackGuard(irb.CreateICmpEQ(expected, ret_addr));
+}
+
+void LifterBase::ShadowStackGuard(llvm::Value* match) {
+    BasicBlock* mismatch_block = ablock.AddBlock();
+    BasicBlock* cont_block = ablock.AddBlock();
+    ablock.GetInsertBlock()->BranchTo(match, *cont_block, *mismatch_block,
+                                      BasicBlock::Likely::THEN);
+
+    // The caller continues at the expected address, so we must not return.
+    SetInsertBlock(mismatch_block);
+    if (cfg.shadow_ret_stack_mismatch) {
+        CallExternalFunction(cfg.shadow_ret_stack_mismatch);
+    } else {
+        auto id = llvm::Intrinsic::trap;
+        irb.CreateCall(llvm::Intrinsic::getDeclaration(GetModule(), id));
+    }
+    irb.CreateUnreachable();
+
+    SetInsertBlock(cont_block);
+}
+
 void Lifter::LiftSyscall(const Instr& inst) {
     SetReg(X86Reg::RCX, Facet::I64, GetReg(X86Reg::IP, Facet::I64));
     SetReg(X86Reg::GP(11), Facet::I64, FlagAsReg(64));
@@ -589,12 +758,24 @@ LifterBase::RepInfo LifterBase::RepBegin(const Instr& inst) {
         info.cont_block = ablock.AddBlock();
         info.ip = GetReg(X86Reg::IP, Facet::I64);
 
+        // For REPE CMPS, first check the whole range with memcmp and only
+        // enter the loop to find the first mismatch.
+        BasicBlock* enter_block = info.loop_block;
+        if (inst.type() == FDI_CMPS && info.mode == RepInfo::REPZ &&
+            RepLibcallAllowed(inst))
+            enter_block = ablock.AddBlock();
+
         llvm::Value* count = GetReg(X86Reg::RCX, Facet::I64);
         llvm::Value* zero = llvm::Constant::getNullValue(count->getType());
         llvm::Value* enter_loop = irb.CreateICmpNE(count, zero);
-        ablock.GetInsertBlock()->BranchTo(enter_loop, *info.loop_block,
+        ablock.GetInsertBlock()->BranchTo(enter_loop, *enter_block,
                                           *info.cont_block);
 
+        if (enter_block != info.loop_block) {
+            SetInsertBlock(enter_block);
+            RepCmpsLibcall(inst, info);
+        }
+
         SetInsertBlock(info.loop_block);
     }
 
@@ -641,11 +822,124 @@ void LifterBase::RepEnd(RepInfo info) {
     SetReg(X86Reg::IP, Facet::I64, info.ip);
 }
 
+bool LifterBase::RepLibcallAllowed(const Instr& inst) {
+    if (!cfg.string_libcalls || inst.addrsz() != 8)
+        return false;
+    // Only the start address is translated, the library functions would read
+    // an unbounded range behind it, escaping the sandbox or crossing guest
+    // pages which aren't contiguous in the host.
+    if (HasGuestAddrSpace())
+        return false;
+    // Library functions only scan upwards.
+    auto df = llvm::dyn_cast<llvm::ConstantInt>(GetFlag(Facet::DF));
+    return df && df->isZero();
+}
+
+void LifterBase::RepCmpsLibcall(const Instr& inst, RepInfo& info) {
+    llvm::Type* i8p = irb.getInt8PtrTy();
+    llvm::Value* count = GetReg(X86Reg::RCX, Facet::I64);
+
+    // memcmp may read the whole range even after a difference, so limit this
+    // to 4 KiB; this also keeps the length from overflowing.
+    BasicBlock* call_block = ablock.AddBlock();
+    llvm::Value* max_count = irb.getInt64(0x1000 / inst.opsz());
+    llvm::Value* short_range = irb.CreateICmpULE(count, max_count);
+    ablock.GetInsertBlock()->BranchTo(short_range, *call_block,
+                                      *info.loop_block);
+    SetInsertBlock(call_block);
+
+    llvm::Value* si = GetReg(X86Reg::RSI, Facet::PTR);
+    llvm::Value* di = GetReg(X86Reg::RDI, Facet::PTR);
+    si = irb.CreatePointerCast(si, i8p);
+    di = irb.CreatePointerCast(di, i8p);
+    llvm::Value* len = irb.CreateMul(count, irb.getInt64(inst.opsz()));
+
+    auto memcmp_fn = GetModule()->getOrInsertFunction("memcmp",
+            irb.getInt32Ty(), i8p, i8p, irb.getInt64Ty());
+    llvm::Value* cmp_res =
+        irb.CreateCall(memcmp_fn, {HostPtr(si), HostPtr(di), len});
+
+    BasicBlock* equal_block = ablock.AddBlock();
+    llvm::Value* equal = irb.CreateICmpEQ(cmp_res, irb.getInt32(0));
+    ablock.GetInsertBlock()->BranchTo(equal, *equal_block, *info.loop_block);
+
+    // All elements are equal, so is the last one which determines the flags.
+    SetInsertBlock(equal_block);
+    SetRegPtr(X86Reg::RSI, irb.CreateGEP(si, len));
+    SetRegPtr(X86Reg::RDI, irb.CreateGEP(di, len));
+    SetReg(X86Reg::RCX, Facet::I64, irb.getInt64(0));
+    SetFlag(Facet::ZF, irb.getTrue());
+    SetFlag(Facet::SF, irb.getFalse());
+    SetFlag(Facet::PF, irb.getTrue());
+    SetFlag(Facet::AF, irb.getFalse());
+    SetFlag(Facet::CF, irb.getFalse());
+    SetFlag(Facet::OF, irb.getFalse());
+    ablock.GetInsertBlock()->BranchTo(*info.cont_block);
+}
+
+bool LifterBase::RepScasLibcall(const Instr& inst) {
+    if (!inst.has_repnz() || inst.opsz() != 1 || !RepLibcallAllowed(inst))
+        return false;
+
+    BasicBlock* call_block = ablock.AddBlock();
+    BasicBlock* cont_block = ablock.AddBlock();
+    llvm::Value* ip = GetReg(X86Reg::IP, Facet::I64);
+
+    llvm::Value* count = GetReg(X86Reg::RCX, Facet::I64);
+    llvm::Value* zero = llvm::Constant::getNullValue(count->getType());
+    llvm::Value* enter = irb.CreateICmpNE(count, zero);
+    ablock.GetInsertBlock()->BranchTo(enter, *call_block, *cont_block);
+    SetInsertBlock(call_block);
+
+    llvm::Type* i8p = irb.getInt8PtrTy();
+    llvm::Value* di = GetReg(X86Reg::RDI, Facet::PTR);
+    di = irb.CreatePointerCast(di, i8p);
+    llvm::Value* host_di = HostPtr(di);
+    llvm::Value* al = GetReg(X86Reg::RAX, Facet::I8);
+
+    // Index of the last element compared.
+    llvm::Value* idx;
+    auto count_const = llvm::dyn_cast<llvm::ConstantInt>(count);
+    auto al_const = llvm::dyn_cast<llvm::ConstantInt>(al);
+    if (count_const && count_const->isMinusOne() && al_const &&
+        al_const->isZero()) {
+        // The strlen idiom: mov rcx, -1; xor eax, eax; repne scasb
+        auto strlen_fn = GetModule()->getOrInsertFunction("strlen",
+                irb.getInt64Ty(), i8p);
+        idx = irb.CreateCall(strlen_fn, {host_di});
+    } else {
+        auto memchr_fn = GetModule()->getOrInsertFunction("memchr",
+                i8p, i8p, irb.getInt32Ty(), irb.getInt64Ty());
+        llvm::Value* al_ext = irb.CreateZExt(al, irb.getInt32Ty());
+        llvm::Value* match =
+            irb.CreateCall(memchr_fn, {host_di, al_ext, count});
+        llvm::Value* found = irb.CreateIsNotNull(match);
+        llvm::Value* last = irb.CreateSub(count, irb.getInt64(1));
+        idx = irb.CreateSelect(found, irb.CreatePtrDiff(match, host_di), last);
+    }
+
+    // Flags come from the last comparison; if AL was found, this compares AL
+    // with itself.
+    llvm::Value* dst_ptr = irb.CreateGEP(host_di, idx);
+    llvm::Value* dst = irb.CreateLoad(irb.getInt8Ty(), dst_ptr);
+    FlagCalcSub(irb.CreateSub(al, dst), al, dst);
+
+    llvm::Value* scanned = irb.CreateAdd(idx, irb.getInt64(1));
+    SetRegPtr(X86Reg::RDI, irb.CreateGEP(di, scanned));
+    SetReg(X86Reg::RCX, Facet::I64, irb.CreateSub(count, scanned));
+
+    ablock.GetInsertBlock()->BranchTo(*cont_block);
+    SetInsertBlock(cont_block);
+    SetReg(X86Reg::IP, Facet::I64, ip);
+    return true;
+}
+
 void Lifter::LiftLods(const Instr& inst) {
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
     unsigned size = inst.opsz();
-    OpStoreGp(X86Reg::RAX, irb.CreateLoad(irb.getIntNTy(size), rep_info.di));
+    llvm::Value* src = HostPtr(rep_info.si);
+    OpStoreGp(X86Reg::RAX, irb.CreateLoad(irb.getIntNTy(size), src));
 
     RepEnd(rep_info); // NOTE: this modifies control flow!
 }
@@ -656,7 +950,7 @@ void Lifter::LiftStos(const Instr& inst) {
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
     auto ax = GetReg(X86Reg::RAX, Facet::In(inst.opsz() * 8));
-    irb.CreateStore(ax, rep_info.di);
+    irb.CreateStore(ax, HostPtr(rep_info.di));
 
     RepEnd(rep_info); // NOTE: this modifies control flow!
 }
@@ -665,16 +959,20 @@ void Lifter::LiftMovs(const Instr& inst) {
     // TODO: optimize REP MOVSB to use llvm memcpy intrinsic.
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
-    irb.CreateStore(irb.CreateLoad(rep_info.si), rep_info.di);
+    llvm::Value* src = irb.CreateLoad(HostPtr(rep_info.si));
+    irb.CreateStore(src, HostPtr(rep_info.di));
 
     RepEnd(rep_info); // NOTE: this modifies control flow!
 }
 
 void Lifter::LiftScas(const Instr& inst) {
+    if (RepScasLibcall(inst))
+        return;
+
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
     auto src = GetReg(X86Reg::RAX, Facet::In(inst.opsz() * 8));
-    llvm::Value* dst = irb.CreateLoad(rep_info.di);
+    llvm::Value* dst = irb.CreateLoad(HostPtr(rep_info.di));
     // Perform a normal CMP operation.
     FlagCalcSub(irb.CreateSub(src, dst), src, dst);
 
@@ -684,8 +982,8 @@ void Lifter::LiftScas(const Instr& inst) {
 void Lifter::LiftCmps(const Instr& inst) {
     RepInfo rep_info = RepBegin(inst); // NOTE: this modifies control flow!
 
-    llvm::Value* src = irb.CreateLoad(rep_info.si);
-    llvm::Value* dst = irb.CreateLoad(rep_info.di);
+    llvm::Value* src = irb.CreateLoad(HostPtr(rep_info.si));
+    llvm::Value* dst = irb.CreateLoad(HostPtr(rep_info.di));
     // Perform a normal CMP operation.
     FlagCalcSub(irb.CreateSub(src, dst), src, dst);
 
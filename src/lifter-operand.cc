@@ -30,6 +30,7 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 
@@ -52,6 +53,8 @@ X86Reg LifterBase::MapReg(const Instr::Reg reg) {
         return X86Reg::GP(reg.ri - FD_REG_AH);
     else if (reg.rt == FD_RT_VEC)
         return X86Reg::VEC(reg.ri);
+    else if (reg.rt == FD_RT_FPU)
+        return X86Reg::X87(reg.ri);
     return X86Reg();
 }
 
@@ -59,7 +62,7 @@ llvm::Value* LifterBase::OpAddrConst(uint64_t addr, llvm::PointerType* ptr_ty) {
     if (addr == 0)
         return llvm::ConstantPointerNull::get(ptr_ty);
 
-    if (cfg.global_base_value) {
+    if (cfg.global_base_value && !HasGuestAddrSpace()) {
         uintptr_t offset = addr - cfg.global_base_addr;
         auto ptr = irb.CreateGEP(cfg.global_base_value, irb.getInt64(offset));
         return irb.CreatePointerCast(ptr, ptr_ty);
@@ -68,8 +71,78 @@ llvm::Value* LifterBase::OpAddrConst(uint64_t addr, llvm::PointerType* ptr_ty) {
     return irb.CreateIntToPtr(irb.getInt64(addr), ptr_ty);
 }
 
+llvm::Value* LifterBase::TlbLookup(llvm::Value* guest_ptr) {
+    llvm::Type* i64 = irb.getInt64Ty();
+    llvm::Value* addr = irb.CreatePtrToInt(guest_ptr, i64);
+    llvm::Value* page = irb.CreateLShr(addr, cfg.tlb_page_bits);
+    llvm::Value* idx = irb.CreateAnd(page, (uint64_t{1} << cfg.tlb_bits) - 1);
+
+    llvm::Type* entry_ty = llvm::StructType::get(i64, i64);
+    llvm::Value* tlb = irb.CreatePointerCast(cfg.tlb, entry_ty->getPointerTo());
+    llvm::Value* entry = irb.CreateGEP(tlb, idx);
+    llvm::Value* tag = irb.CreateLoad(irb.CreateConstGEP2_32(entry_ty, entry,
+                                                             0, 0));
+    llvm::Value* addend = irb.CreateLoad(irb.CreateConstGEP2_32(entry_ty, entry,
+                                                                0, 1));
+    llvm::Value* hit_addr = irb.CreateAdd(addr, addend);
+    llvm::Value* hit = irb.CreateICmpEQ(tag, page);
+
+    BasicBlock* hit_block = ablock.GetInsertBlock();
+    BasicBlock* miss_block = ablock.AddBlock();
+    BasicBlock* cont_block = ablock.AddBlock();
+    llvm::BasicBlock* hit_llvm_block = irb.GetInsertBlock();
+    hit_block->BranchTo(hit, *cont_block, *miss_block,
+                        BasicBlock::Likely::THEN);
+
+    SetInsertBlock(miss_block);
+    // The miss function may inspect the CPU state, e.g. to report a fault.
+    llvm::CallInst* miss_ptr = CallConv::CallInspect(cfg.tlb_miss_function,
+                                                     {addr}, miss_block, fi);
+    miss_ptr->addAttribute(llvm::AttributeList::FunctionIndex,
+                           llvm::Attribute::Cold);
+    llvm::Value* miss_addr = irb.CreatePtrToInt(miss_ptr, i64);
+    llvm::BasicBlock* miss_llvm_block = irb.GetInsertBlock();
+    miss_block->BranchTo(*cont_block);
+
+    SetInsertBlock(cont_block);
+    llvm::PHINode* host_addr = irb.CreatePHI(i64, 2);
+    host_addr->addIncoming(hit_addr, hit_llvm_block);
+    host_addr->addIncoming(miss_addr, miss_llvm_block);
+    return irb.CreateIntToPtr(host_addr, guest_ptr->getType());
+}
+
+llvm::Value* LifterBase::HostPtr(llvm::Value* guest_ptr) {
+    llvm::Value* host_ptr = guest_ptr;
+    if (cfg.tlb) {
+        host_ptr = TlbLookup(guest_ptr);
+    } else if (cfg.sandbox_base) {
+        llvm::Value* addr = irb.CreatePtrToInt(guest_ptr, irb.getInt64Ty());
+        if (cfg.sandbox_mask != UINT64_MAX)
+            addr = irb.CreateAnd(addr, irb.getInt64(cfg.sandbox_mask));
+        llvm::Value* base =
+            irb.CreatePointerCast(cfg.sandbox_base, irb.getInt8PtrTy());
+        llvm::Value* ptr = irb.CreateGEP(base, addr);
+        host_ptr = irb.CreatePointerCast(ptr, guest_ptr->getType());
+    }
+
+    // The stack map is placed before the access in the same block, so the
+    // closest preceding record identifies a faulting instruction. Records are
+    // barriers for memory optimizations, so further accesses of the same
+    // instruction in the same block don't get another one.
+    if (cfg.rip_stackmaps && (stackmap_addr != inst_addr ||
+                              stackmap_block != irb.GetInsertBlock())) {
+        auto id = llvm::Intrinsic::experimental_stackmap;
+        llvm::Function* fn = llvm::Intrinsic::getDeclaration(GetModule(), id);
+        irb.CreateCall(fn, {irb.getInt64(inst_addr), irb.getInt32(0)});
+        stackmap_addr = inst_addr;
+        stackmap_block = irb.GetInsertBlock();
+    }
+
+    return host_ptr;
+}
+
 llvm::Value* LifterBase::OpAddr(const Instr::Op op, llvm::Type* element_type,
-                                unsigned seg) {
+                                unsigned seg, bool host) {
     if (seg == FD_REG_FS || seg == FD_REG_GS || op.addrsz() != 8) {
         // For segment offsets, use inttoptr because the pointer base is stored
         // in the segment register. (And LLVM has some problems with addrspace
@@ -86,19 +159,23 @@ llvm::Value* LifterBase::OpAddr(const Instr::Op op, llvm::Type* element_type,
             res = irb.CreateAdd(res, irb.CreateMul(ireg, scaled_val));
         }
 
+        res = irb.CreateZExt(res, irb.getInt64Ty());
+
         int addrspace = 0;
         if (seg == FD_REG_FS || seg == FD_REG_GS) {
-            if (cfg.use_native_segment_base) {
+            if (cfg.use_native_segment_base && !HasGuestAddrSpace()) {
                 addrspace = seg == FD_REG_FS ? 257 : 256;
             } else {
-                unsigned idx =
-                    seg == FD_REG_FS ? SptrIdx::FSBASE : SptrIdx::GSBASE;
-                res = irb.CreateAdd(res, irb.CreateLoad(fi.sptr[idx]));
+                // The segment base is kept in the register file, so repeated
+                // accesses don't reload it from the CPU struct.
+                X86Reg seg_reg =
+                    seg == FD_REG_FS ? X86Reg::FSBASE : X86Reg::GSBASE;
+                res = irb.CreateAdd(res, GetReg(seg_reg, Facet::I64));
             }
         }
 
-        res = irb.CreateZExt(res, irb.getInt64Ty());
-        return irb.CreateIntToPtr(res, element_type->getPointerTo(addrspace));
+        res = irb.CreateIntToPtr(res, element_type->getPointerTo(addrspace));
+        return host ? HostPtr(res) : res;
     }
 
     llvm::PointerType* elem_ptr_ty = element_type->getPointerTo();
@@ -145,7 +222,8 @@ llvm::Value* LifterBase::OpAddr(const Instr::Op op, llvm::Type* element_type,
         }
     }
 
-    return irb.CreatePointerCast(base, elem_ptr_ty);
+    base = irb.CreatePointerCast(base, elem_ptr_ty);
+    return host ? HostPtr(base) : base;
 }
 
 static void ll_operand_set_alignment(llvm::Instruction* value, llvm::Type* type,
@@ -223,6 +301,22 @@ void LifterBase::OpStoreGp(X86Reg reg, Facet facet, llvm::Value* value) {
     SetRegFacet(reg, facet, value); // Store facet value as well
 }
 
+void LifterBase::OpStoreGpPtrAdd(X86Reg reg, llvm::Value* value, X86Reg base,
+                                 llvm::Value* offset) {
+    assert(value->getType()->isIntegerTy(64));
+    // Only keep a pointer facet if base is currently used as pointer, integer
+    // arithmetic should not turn into ptrtoint/GEP chains. A pointer facet
+    // which is still a pending PHI is not used, the add alone must not make
+    // the PHI live.
+    llvm::Value* base_ptr = regfile->GetRegFacet(base, Facet::PTR);
+    OpStoreGp(reg, Facet::I64, value);
+    if (!base_ptr)
+        return;
+    unsigned as = base_ptr->getType()->getPointerAddressSpace();
+    base_ptr = irb.CreatePointerCast(base_ptr, irb.getInt8PtrTy(as));
+    SetRegFacet(reg, Facet::PTR, irb.CreateGEP(base_ptr, offset));
+}
+
 void LifterBase::OpStoreGp(const Instr::Op op, llvm::Value* value,
                            Alignment alignment) {
     if (op.is_mem()) {
@@ -265,6 +359,13 @@ void LifterBase::OpStoreVec(const Instr::Op op, llvm::Value* value, bool avx,
         return;
     }
 
+    // Scalar writes without zeroing the upper part are tracked in the register
+    // file so that scalar code doesn't need to assemble a vector each time.
+    if (!avx && !value_ty->isVectorTy()) {
+        regfile->SetRegScalar(reg, value);
+        return;
+    }
+
     // Construct the requires vector type of the vector register.
     llvm::Type* element_ty =
         value_ty->isVectorTy() ? value_ty->getVectorElementType() : value_ty;
@@ -304,7 +405,7 @@ void LifterBase::StackPush(llvm::Value* value) {
     llvm::Value* rsp = GetReg(X86Reg::RSP, Facet::PTR);
     rsp = irb.CreatePointerCast(rsp, value->getType()->getPointerTo());
     rsp = irb.CreateConstGEP1_64(rsp, -1);
-    irb.CreateStore(value, rsp);
+    irb.CreateStore(value, HostPtr(rsp));
 
     SetRegPtr(X86Reg::RSP, rsp);
 }
@@ -315,7 +416,7 @@ llvm::Value* LifterBase::StackPop(const X86Reg sp_src_reg) {
 
     SetRegPtr(X86Reg::RSP, irb.CreateConstGEP1_64(rsp, 1));
 
-    return irb.CreateLoad(rsp);
+    return irb.CreateLoad(HostPtr(rsp));
 }
 
 } // namespace rellume
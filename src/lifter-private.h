@@ -70,6 +70,12 @@ protected:
     llvm::IRBuilder<> irb;
     const LLConfig& cfg;
 
+    /// Address of the instruction being lifted
+    uint64_t inst_addr = 0;
+    /// Last stack map record, see HostPtr
+    uint64_t stackmap_addr = 0;
+    llvm::BasicBlock* stackmap_block = nullptr;
+
     LifterBase(FunctionInfo& fi, const LLConfig& cfg, ArchBasicBlock& ab)
             : fi(fi), ablock(ab),regfile(ab.GetInsertBlock()->GetRegFile()),
               irb(regfile->GetInsertBlock()), cfg(cfg) {
@@ -119,6 +125,21 @@ protected:
     }
     void SetIP(uint64_t inst_addr, bool nofold = false);
 
+    /// Facet used for computations on x87 registers.
+    Facet X87Facet() const {
+        return cfg.x87_double ? Facet::F64 : Facet::F80;
+    }
+    void X87AdjustTop(int delta) {
+        regfile->AdjustX87Top(delta);
+    }
+    void X87Push(llvm::Value* value) {
+        X87AdjustTop(-1);
+        SetReg(X86Reg::X87(0), Facet::FromType(value->getType()), value);
+    }
+    void X87Pop() {
+        X87AdjustTop(1);
+    }
+
 private:
     void SetInsertBlock(BasicBlock* block) {
         ablock.SetInsertBlock(block);
@@ -127,14 +148,23 @@ private:
     }
 
     llvm::Value* OpAddrConst(uint64_t addr, llvm::PointerType* ptr_ty);
+    llvm::Value* TlbLookup(llvm::Value* guest_ptr);
 protected:
-    llvm::Value* OpAddr(const Instr::Op op, llvm::Type* element_type, unsigned seg);
+    /// Whether guest addresses differ from host addresses.
+    bool HasGuestAddrSpace() const {
+        return cfg.tlb || cfg.sandbox_base;
+    }
+    llvm::Value* OpAddr(const Instr::Op op, llvm::Type* element_type, unsigned seg, bool host = true);
+    llvm::Value* HostPtr(llvm::Value* guest_ptr);
     llvm::Value* OpLoad(const Instr::Op op, Facet facet, Alignment alignment = ALIGN_NONE, unsigned force_seg = 7);
     void OpStoreGp(X86Reg reg, llvm::Value* v) {
         OpStoreGp(reg, Facet::In(v->getType()->getIntegerBitWidth()), v);
     }
     void OpStoreGp(X86Reg reg, Facet facet, llvm::Value* value);
     void OpStoreGp(const Instr::Op op, llvm::Value* value, Alignment alignment = ALIGN_NONE);
+    /// Store value = base + offset into a 64-bit register and derive the
+    /// pointer facet from the pointer facet of base, if present.
+    void OpStoreGpPtrAdd(X86Reg reg, llvm::Value* value, X86Reg base, llvm::Value* offset);
     void OpStoreVec(const Instr::Op op, llvm::Value* value, bool avx = false, Alignment alignment = ALIGN_IMP);
     void StackPush(llvm::Value* value);
     llvm::Value* StackPop(const X86Reg sp_src_reg = X86Reg::RSP);
@@ -171,6 +201,9 @@ protected:
     };
     RepInfo RepBegin(const Instr& inst);
     void RepEnd(RepInfo info);
+    bool RepLibcallAllowed(const Instr& inst);
+    void RepCmpsLibcall(const Instr& inst, RepInfo& info);
+    bool RepScasLibcall(const Instr& inst);
 
     // Helper function for older LLVM versions
     llvm::Value* CreateUnaryIntrinsic(llvm::Intrinsic::ID id, llvm::Value* v) {
@@ -180,6 +213,10 @@ protected:
 
     void CallExternalFunction(llvm::Function* fn);
 
+    void ShadowStackPush(llvm::Value* ret_addr);
+    void ShadowStackCheck(llvm::Value* ret_addr);
+    void ShadowStackGuard(llvm::Value* match);
+
     void ForceReturn() {
         cfg.callconv.Return(ablock.GetInsertBlock(), fi);
     }
@@ -241,6 +278,7 @@ private:
     void LiftJcxz(const Instr& inst);
     void LiftLoop(const Instr& inst);
     void LiftCall(const Instr& inst);
+    bool LiftCallNative(const Instr& inst, llvm::Function* fn);
     void LiftRet(const Instr& inst);
     void LiftSyscall(const Instr& inst);
 
@@ -263,7 +301,9 @@ private:
                       Facet type);
     void LiftSseMovScalar(const Instr&, Facet);
     void LiftSseMovdq(const Instr&, Facet, Alignment);
-    void LiftSseMovntStore(const Instr&, Facet);
+    void SetNontemporal(llvm::Instruction*);
+    void LiftMovntStore(const Instr&, Facet, Alignment);
+    void LiftSseMovntLoad(const Instr&, Facet);
     void LiftSseMovlp(const Instr&);
     void LiftSseMovhps(const Instr&);
     void LiftSseMovhpd(const Instr&);
@@ -293,6 +333,20 @@ private:
     void LiftSsePcmp(const Instr&, llvm::CmpInst::Predicate, Facet);
     void LiftSsePminmax(const Instr&, llvm::CmpInst::Predicate, Facet);
     void LiftSseMovmsk(const Instr&, Facet op_type);
+
+    // lifter-x87.cc
+    llvm::Value* X87OpLoad(const Instr::Op op, bool integer);
+    void LiftX87Ld(const Instr&, bool integer);
+    void LiftX87Ldconst(const Instr&, const char* value);
+    void LiftX87St(const Instr&, bool pop);
+    void LiftX87Ist(const Instr&, bool pop, bool truncate);
+    void LiftX87Xch(const Instr&);
+    void LiftX87Arith(const Instr&, llvm::Instruction::BinaryOps op,
+                      bool reverse, bool pop, bool integer = false);
+    void LiftX87Unary(const Instr&, llvm::Intrinsic::ID id);
+    void LiftX87Chs(const Instr&);
+    void LiftX87Comi(const Instr&, bool pop);
+    void LiftX87Cmov(const Instr&, Condition cond);
 };
 
 } // namespace
@@ -41,8 +41,19 @@
 namespace rellume {
 
 void Lifter::LiftFence(const Instr& inst) {
-    // TODO: distinguish also lfence and sfence.
-    irb.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
+    // Non-temporal stores are weakly ordered and LLVM emits no instruction
+    // for acquire/release fences on x86, so LFENCE and SFENCE are kept as
+    // the target intrinsics. A sequentially consistent fence becomes MFENCE.
+    llvm::Intrinsic::ID id;
+    switch (inst.type()) {
+    case FDI_LFENCE: id = llvm::Intrinsic::x86_sse2_lfence; break;
+    case FDI_SFENCE: id = llvm::Intrinsic::x86_sse_sfence; break;
+    default:
+        irb.CreateFence(llvm::AtomicOrdering::SequentiallyConsistent);
+        return;
+    }
+    llvm::Module* module = irb.GetInsertBlock()->getModule();
+    irb.CreateCall(llvm::Intrinsic::getDeclaration(module, id, {}));
 }
 
 void Lifter::LiftPrefetch(const Instr& inst, unsigned rw, unsigned locality) {
@@ -64,6 +75,12 @@ void Lifter::LiftFxsave(const Instr& inst) {
     // Zero FPU status
     // TODO: FCW=0x37f, MXCSR=0x1f80, MXCSR_MASK=0xffff
     irb.CreateMemSet(buf, irb.getInt8(0), 0xa0, 16);
+    llvm::Type* f80_ty = Facet{Facet::F80}.Type(irb.getContext());
+    for (unsigned i = 0; i < 8; i++) {
+        llvm::Value* ptr = irb.CreateConstGEP1_32(buf, 0x20 + 0x10 * i);
+        ptr = irb.CreatePointerCast(ptr, f80_ty->getPointerTo());
+        irb.CreateStore(GetReg(X86Reg::X87(i), Facet::F80), ptr);
+    }
     for (unsigned i = 0; i < 16; i++) {
         llvm::Value* ptr = irb.CreateConstGEP1_32(buf, 0xa0 + 0x10 * i);
         ptr = irb.CreatePointerCast(ptr, irb.getIntNTy(128)->getPointerTo());
@@ -76,6 +93,12 @@ void Lifter::LiftFxrstor(const Instr& inst) {
     llvm::Module* mod = irb.GetInsertBlock()->getModule();
     irb.CreateAlignmentAssumption(mod->getDataLayout(), buf, 16);
 
+    llvm::Type* f80_ty = Facet{Facet::F80}.Type(irb.getContext());
+    for (unsigned i = 0; i < 8; i++) {
+        llvm::Value* ptr = irb.CreateConstGEP1_32(buf, 0x20 + 0x10 * i);
+        ptr = irb.CreatePointerCast(ptr, f80_ty->getPointerTo());
+        SetReg(X86Reg::X87(i), Facet::F80, irb.CreateLoad(ptr));
+    }
     for (unsigned i = 0; i < 16; i++) {
         llvm::Value* ptr = irb.CreateConstGEP1_32(buf, 0xa0 + 0x10 * i);
         ptr = irb.CreatePointerCast(ptr, irb.getIntNTy(128)->getPointerTo());
@@ -127,15 +150,31 @@ void Lifter::LiftSseMovdq(const Instr& inst, Facet facet, Alignment alignment) {
     OpStoreVec(inst.op(0), OpLoad(inst.op(1), facet, alignment), alignment);
 }
 
-void Lifter::LiftSseMovntStore(const Instr& inst, Facet facet) {
+void Lifter::SetNontemporal(llvm::Instruction* inst) {
+    llvm::Metadata* const_1 = llvm::ConstantAsMetadata::get(irb.getInt32(1));
+    llvm::MDNode* node = llvm::MDNode::get(inst->getContext(), const_1);
+    inst->setMetadata(GetModule()->getMDKindID("nontemporal"), node);
+}
+
+void Lifter::LiftMovntStore(const Instr& inst, Facet facet,
+                            Alignment alignment) {
     llvm::Value* value = OpLoad(inst.op(1), facet, ALIGN_MAX);
     llvm::Value* addr = OpAddr(inst.op(0), value->getType(), inst.op(0).seg());
     llvm::StoreInst* store = irb.CreateStore(value, addr);
-    store->setAlignment(value->getType()->getPrimitiveSizeInBits() / 8);
+    if (alignment == ALIGN_MAX)
+        store->setAlignment(value->getType()->getPrimitiveSizeInBits() / 8);
+    else
+        store->setAlignment(1);
+    SetNontemporal(store);
+}
 
-    llvm::Metadata* const_1 = llvm::ConstantAsMetadata::get(irb.getInt32(1));
-    llvm::MDNode* node = llvm::MDNode::get(store->getContext(), const_1);
-    store->setMetadata(GetModule()->getMDKindID("nontemporal"), node);
+void Lifter::LiftSseMovntLoad(const Instr& inst, Facet facet) {
+    llvm::Type* type = facet.Type(irb.getContext());
+    llvm::Value* addr = OpAddr(inst.op(1), type, inst.op(1).seg());
+    llvm::LoadInst* load = irb.CreateLoad(type, addr);
+    load->setAlignment(type->getPrimitiveSizeInBits() / 8);
+    SetNontemporal(load);
+    OpStoreVec(inst.op(0), load);
 }
 
 void Lifter::LiftSseMovlp(const Instr& inst) {
@@ -0,0 +1,181 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2016-2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "lifter-private.h"
+
+#include "facet.h"
+#include "instr.h"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Value.h>
+
+/**
+ * \defgroup LLInstructionX87 x87 Instructions
+ * \ingroup LLInstruction
+ *
+ * The x87 registers are addressed relative to the top of stack. Pushes and
+ * pops only rename the registers in the register file, so the stack pointer
+ * is never materialized. Status word, tag word and the control word are not
+ * modeled; all operations round to nearest with full precision.
+ *
+ * @{
+ **/
+
+namespace rellume {
+
+llvm::Value* Lifter::X87OpLoad(const Instr::Op op, bool integer) {
+    if (op.is_reg())
+        return GetReg(MapReg(op.reg()), X87Facet());
+
+    llvm::Type* type = X87Facet().Type(irb.getContext());
+    if (integer)
+        return irb.CreateSIToFP(OpLoad(op, Facet::I), type);
+
+    Facet facet;
+    switch (op.bits()) {
+    case 32: facet = Facet::F32; break;
+    case 64: facet = Facet::F64; break;
+    case 80: facet = Facet::F80; break;
+    default:
+        assert(false && "invalid size for x87 memory operand");
+        return nullptr;
+    }
+    return irb.CreateFPCast(OpLoad(op, facet), type);
+}
+
+void Lifter::LiftX87Ld(const Instr& inst, bool integer) {
+    // Read the operand before the push, ST(i) refers to the old stack.
+    X87Push(X87OpLoad(inst.op(0), integer));
+}
+
+void Lifter::LiftX87Ldconst(const Instr& inst, const char* value) {
+    // The constant is rounded to the precision of the type.
+    llvm::Type* type = X87Facet().Type(irb.getContext());
+    X87Push(llvm::ConstantFP::get(type, value));
+}
+
+void Lifter::LiftX87St(const Instr& inst, bool pop) {
+    llvm::Value* value = GetReg(X86Reg::X87(0), X87Facet());
+    if (inst.op(0).is_reg()) {
+        SetReg(MapReg(inst.op(0).reg()), X87Facet(), value);
+    } else {
+        llvm::Type* type;
+        switch (inst.op(0).bits()) {
+        case 32: type = irb.getFloatTy(); break;
+        case 64: type = irb.getDoubleTy(); break;
+        default: type = Facet{Facet::F80}.Type(irb.getContext()); break;
+        }
+        OpStoreGp(inst.op(0), irb.CreateFPCast(value, type));
+    }
+    if (pop)
+        X87Pop();
+}
+
+void Lifter::LiftX87Ist(const Instr& inst, bool pop, bool truncate) {
+    llvm::Value* value = GetReg(X86Reg::X87(0), X87Facet());
+    // FISTTP always truncates, FIST(P) round to nearest as the default
+    // control word. Values out of range don't yield the integer indefinite.
+    if (!truncate)
+        value = CreateUnaryIntrinsic(llvm::Intrinsic::rint, value);
+    llvm::Type* int_ty = irb.getIntNTy(inst.op(0).bits());
+    OpStoreGp(inst.op(0), irb.CreateFPToSI(value, int_ty));
+    if (pop)
+        X87Pop();
+}
+
+void Lifter::LiftX87Xch(const Instr& inst) {
+    // FXCH without operand exchanges ST(0) and ST(1).
+    X86Reg reg = X86Reg::X87(1);
+    if (inst.op(1))
+        reg = MapReg(inst.op(1).reg());
+    else if (inst.op(0))
+        reg = MapReg(inst.op(0).reg());
+
+    llvm::Value* st0 = GetReg(X86Reg::X87(0), X87Facet());
+    llvm::Value* sti = GetReg(reg, X87Facet());
+    SetReg(X86Reg::X87(0), X87Facet(), sti);
+    SetReg(reg, X87Facet(), st0);
+}
+
+void Lifter::LiftX87Arith(const Instr& inst, llvm::Instruction::BinaryOps op,
+                          bool reverse, bool pop, bool integer) {
+    // Forms: OP ST(0), m/ST(i); OP ST(i), ST(0); OP m; OPP ST(i); OPP.
+    X86Reg dst = X86Reg::X87(0);
+    llvm::Value* src;
+    if (inst.op(1)) {
+        dst = MapReg(inst.op(0).reg());
+        src = X87OpLoad(inst.op(1), integer);
+    } else if (inst.op(0) && (!pop || !inst.op(0).is_reg())) {
+        src = X87OpLoad(inst.op(0), integer);
+    } else {
+        dst = inst.op(0) ? MapReg(inst.op(0).reg()) : X86Reg::X87(1);
+        src = GetReg(X86Reg::X87(0), X87Facet());
+    }
+
+    llvm::Value* dst_val = GetReg(dst, X87Facet());
+    llvm::Value* res = reverse ? irb.CreateBinOp(op, src, dst_val)
+                               : irb.CreateBinOp(op, dst_val, src);
+    SetReg(dst, X87Facet(), res);
+    if (pop)
+        X87Pop();
+}
+
+void Lifter::LiftX87Unary(const Instr& inst, llvm::Intrinsic::ID id) {
+    llvm::Value* value = GetReg(X86Reg::X87(0), X87Facet());
+    SetReg(X86Reg::X87(0), X87Facet(), CreateUnaryIntrinsic(id, value));
+}
+
+void Lifter::LiftX87Chs(const Instr& inst) {
+    llvm::Value* value = GetReg(X86Reg::X87(0), X87Facet());
+    SetReg(X86Reg::X87(0), X87Facet(), irb.CreateFNeg(value));
+}
+
+void Lifter::LiftX87Comi(const Instr& inst, bool pop) {
+    const Instr::Op src_op = inst.op(1) ? inst.op(1) : inst.op(0);
+    llvm::Value* op1 = GetReg(X86Reg::X87(0), X87Facet());
+    llvm::Value* op2 = GetReg(MapReg(src_op.reg()), X87Facet());
+    SetFlag(Facet::ZF, irb.CreateFCmpUEQ(op1, op2));
+    SetFlag(Facet::CF, irb.CreateFCmpULT(op1, op2));
+    SetFlag(Facet::PF, irb.CreateFCmpUNO(op1, op2));
+    SetFlag(Facet::AF, irb.getFalse());
+    SetFlag(Facet::OF, irb.getFalse());
+    SetFlag(Facet::SF, irb.getFalse());
+    if (pop)
+        X87Pop();
+}
+
+void Lifter::LiftX87Cmov(const Instr& inst, Condition cond) {
+    const Instr::Op src_op = inst.op(1) ? inst.op(1) : inst.op(0);
+    llvm::Value* dst = GetReg(X86Reg::X87(0), X87Facet());
+    llvm::Value* src = GetReg(MapReg(src_op.reg()), X87Facet());
+    llvm::Value* res = irb.CreateSelect(FlagCond(cond), src, dst);
+    SetReg(X86Reg::X87(0), X87Facet(), res);
+}
+
+} // namespace
+
+/**
+ * @}
+ **/
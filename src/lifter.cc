@@ -67,6 +67,8 @@ void LifterBase::CallExternalFunction(llvm::Function* fn) {
 }
 
 bool Lifter::Lift(const Instr& inst) {
+    inst_addr = inst.start();
+
     // Set new instruction pointer register
     SetIP(inst.end());
 
@@ -124,8 +126,7 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_MOVABS: LiftMovgp(inst, llvm::Instruction::SExt); break;
     case FDI_MOVZX: LiftMovgp(inst, llvm::Instruction::ZExt); break;
     case FDI_MOVSX: LiftMovgp(inst, llvm::Instruction::SExt); break;
-    // TODO: set non-temporal hint
-    case FDI_MOVNTI: LiftMovgp(inst, llvm::Instruction::SExt); break;
+    case FDI_MOVNTI: LiftMovntStore(inst, Facet::I, ALIGN_NONE); break;
     case FDI_MOVBE: LiftMovbe(inst); break;
     case FDI_ADD: LiftArith(inst, /*sub=*/false); break;
     case FDI_ADC: LiftArith(inst, /*sub=*/false); break;
@@ -240,11 +241,10 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_SSE_MOVAPD: LiftSseMovdq(inst, Facet::V2F64, ALIGN_MAX); break;
     case FDI_SSE_MOVDQU: LiftSseMovdq(inst, Facet::I128, ALIGN_NONE); break;
     case FDI_SSE_MOVDQA: LiftSseMovdq(inst, Facet::I128, ALIGN_MAX); break;
-    case FDI_SSE_MOVNTPS: LiftSseMovntStore(inst, Facet::VF32); break;
-    case FDI_SSE_MOVNTPD: LiftSseMovntStore(inst, Facet::VF64); break;
-    case FDI_SSE_MOVNTDQ: LiftSseMovntStore(inst, Facet::VI64); break;
-    // TODO: set non-temporal hint
-    case FDI_SSE_MOVNTDQA: LiftSseMovdq(inst, Facet::I128, ALIGN_MAX); break;
+    case FDI_SSE_MOVNTPS: LiftMovntStore(inst, Facet::VF32, ALIGN_MAX); break;
+    case FDI_SSE_MOVNTPD: LiftMovntStore(inst, Facet::VF64, ALIGN_MAX); break;
+    case FDI_SSE_MOVNTDQ: LiftMovntStore(inst, Facet::VI64, ALIGN_MAX); break;
+    case FDI_SSE_MOVNTDQA: LiftSseMovntLoad(inst, Facet::I128); break;
     case FDI_SSE_MOVLPS: LiftSseMovlp(inst); break;
     case FDI_SSE_MOVLPD: LiftSseMovlp(inst); break;
     case FDI_SSE_MOVHPS: LiftSseMovhps(inst); break;
@@ -401,6 +401,59 @@ bool Lifter::Lift(const Instr& inst) {
     case FDI_SSE_MOVMSKPS: LiftSseMovmsk(inst, Facet::VI32); break;
     case FDI_SSE_MOVMSKPD: LiftSseMovmsk(inst, Facet::VI64); break;
 
+    // Defined in lifter-x87.cc
+    case FDI_FLD: LiftX87Ld(inst, false); break;
+    case FDI_FILD: LiftX87Ld(inst, true); break;
+    case FDI_FLD1: LiftX87Ldconst(inst, "1"); break;
+    case FDI_FLDZ: LiftX87Ldconst(inst, "0"); break;
+    case FDI_FLDPI: LiftX87Ldconst(inst, "3.14159265358979323846264338327950288"); break;
+    case FDI_FLDL2E: LiftX87Ldconst(inst, "1.44269504088896340735992468100189214"); break;
+    case FDI_FLDL2T: LiftX87Ldconst(inst, "3.32192809488736234787031942948939018"); break;
+    case FDI_FLDLG2: LiftX87Ldconst(inst, "0.301029995663981195213738894724493027"); break;
+    case FDI_FLDLN2: LiftX87Ldconst(inst, "0.693147180559945309417232121458176568"); break;
+    case FDI_FST: LiftX87St(inst, false); break;
+    case FDI_FSTP: LiftX87St(inst, true); break;
+    case FDI_FIST: LiftX87Ist(inst, false, false); break;
+    case FDI_FISTP: LiftX87Ist(inst, true, false); break;
+    case FDI_FISTTP: LiftX87Ist(inst, true, true); break;
+    case FDI_FXCH: LiftX87Xch(inst); break;
+    case FDI_FINCSTP: X87AdjustTop(1); break;
+    case FDI_FDECSTP: X87AdjustTop(-1); break;
+    case FDI_FADD: LiftX87Arith(inst, llvm::Instruction::FAdd, false, false); break;
+    case FDI_FADDP: LiftX87Arith(inst, llvm::Instruction::FAdd, false, true); break;
+    case FDI_FIADD: LiftX87Arith(inst, llvm::Instruction::FAdd, false, false, true); break;
+    case FDI_FSUB: LiftX87Arith(inst, llvm::Instruction::FSub, false, false); break;
+    case FDI_FSUBP: LiftX87Arith(inst, llvm::Instruction::FSub, false, true); break;
+    case FDI_FISUB: LiftX87Arith(inst, llvm::Instruction::FSub, false, false, true); break;
+    case FDI_FSUBR: LiftX87Arith(inst, llvm::Instruction::FSub, true, false); break;
+    case FDI_FSUBRP: LiftX87Arith(inst, llvm::Instruction::FSub, true, true); break;
+    case FDI_FISUBR: LiftX87Arith(inst, llvm::Instruction::FSub, true, false, true); break;
+    case FDI_FMUL: LiftX87Arith(inst, llvm::Instruction::FMul, false, false); break;
+    case FDI_FMULP: LiftX87Arith(inst, llvm::Instruction::FMul, false, true); break;
+    case FDI_FIMUL: LiftX87Arith(inst, llvm::Instruction::FMul, false, false, true); break;
+    case FDI_FDIV: LiftX87Arith(inst, llvm::Instruction::FDiv, false, false); break;
+    case FDI_FDIVP: LiftX87Arith(inst, llvm::Instruction::FDiv, false, true); break;
+    case FDI_FIDIV: LiftX87Arith(inst, llvm::Instruction::FDiv, false, false, true); break;
+    case FDI_FDIVR: LiftX87Arith(inst, llvm::Instruction::FDiv, true, false); break;
+    case FDI_FDIVRP: LiftX87Arith(inst, llvm::Instruction::FDiv, true, true); break;
+    case FDI_FIDIVR: LiftX87Arith(inst, llvm::Instruction::FDiv, true, false, true); break;
+    case FDI_FCHS: LiftX87Chs(inst); break;
+    case FDI_FABS: LiftX87Unary(inst, llvm::Intrinsic::fabs); break;
+    case FDI_FSQRT: LiftX87Unary(inst, llvm::Intrinsic::sqrt); break;
+    case FDI_FRNDINT: LiftX87Unary(inst, llvm::Intrinsic::rint); break;
+    case FDI_FCOMI: LiftX87Comi(inst, false); break;
+    case FDI_FCOMIP: LiftX87Comi(inst, true); break;
+    case FDI_FUCOMI: LiftX87Comi(inst, false); break;
+    case FDI_FUCOMIP: LiftX87Comi(inst, true); break;
+    case FDI_FCMOVB: LiftX87Cmov(inst, Condition::C); break;
+    case FDI_FCMOVE: LiftX87Cmov(inst, Condition::Z); break;
+    case FDI_FCMOVBE: LiftX87Cmov(inst, Condition::BE); break;
+    case FDI_FCMOVU: LiftX87Cmov(inst, Condition::P); break;
+    case FDI_FCMOVNB: LiftX87Cmov(inst, Condition::NC); break;
+    case FDI_FCMOVNE: LiftX87Cmov(inst, Condition::NZ); break;
+    case FDI_FCMOVNBE: LiftX87Cmov(inst, Condition::A); break;
+    case FDI_FCMOVNU: LiftX87Cmov(inst, Condition::NP); break;
+
     // Jumps are handled in the basic block generation code.
     case FDI_JMP: LiftJmp(inst); break;
     case FDI_JO: LiftJcc(inst, Condition::O); break;
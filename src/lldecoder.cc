@@ -24,9 +24,9 @@
 #include "instr.h"
 #include "lifter.h"
 
+#include <algorithm>
 #include <cstdint>
-#include <deque>
-#include <unordered_map>
+#include <cstring>
 #include <vector>
 
 namespace rellume {
@@ -69,42 +69,146 @@ static void InstrFlags(Instr::Type ty, bool* breaks, bool* breaks_cond,
     }
 }
 
-int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
-    Instr inst;
-    uint8_t inst_buf[15];
+namespace {
 
-    std::deque<uintptr_t> addr_queue;
-    addr_queue.push_back(addr);
+struct CallbackReader {
+    RellumeMemAccessCb memacc;
+    void* user_arg;
+    size_t operator()(uintptr_t addr, uint8_t* buf, size_t size) {
+        return memacc(addr, buf, size, user_arg);
+    }
+};
 
-    std::vector<Instr> insts;
-    // List of (start_idx,end_idx) (non-inclusive end)
-    std::vector<std::pair<size_t, size_t>> blocks;
+struct HostReader {
+    size_t operator()(uintptr_t addr, uint8_t* buf, size_t size) {
+        std::memcpy(buf, reinterpret_cast<uint8_t*>(addr), size);
+        return size;
+    }
+};
+
+/// Open-addressed hash map from instruction address to index, with linear
+/// probing. Entries are never removed.
+class AddrIndexMap {
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    size_t Find(uintptr_t addr) const {
+        if (slots.empty())
+            return npos;
+        for (size_t i = Hash(addr);; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i].index == npos || slots[i].addr == addr)
+                return slots[i].index;
+        }
+    }
+
+    void Insert(uintptr_t addr, size_t index) {
+        // Keep the load factor below 1/2.
+        if (2 * (count + 1) > slots.size())
+            Grow();
+        InsertSlot(addr, index);
+        count++;
+    }
+
+private:
+    struct Slot {
+        uintptr_t addr;
+        size_t index;
+    };
 
-    // Mapping from address to (block_idx, instr_idx)
-    std::unordered_map<uintptr_t, std::pair<size_t, size_t>> addr_map;
+    size_t Hash(uintptr_t addr) const {
+        // Fibonacci hashing, the low bits of addresses are poorly distributed.
+        return (addr * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+    }
+
+    void InsertSlot(uintptr_t addr, size_t index) {
+        size_t i = Hash(addr);
+        while (slots[i].index != npos && slots[i].addr != addr)
+            i = (i + 1) & (slots.size() - 1);
+        slots[i] = Slot{addr, index};
+    }
 
-    while (!addr_queue.empty()) {
-        uintptr_t cur_addr = addr_queue.front();
-        addr_queue.pop_front();
+    void Grow() {
+        std::vector<Slot> old_slots(std::move(slots));
+        bits = old_slots.empty() ? 6 : bits + 1;
+        slots.assign(size_t{1} << bits, Slot{0, npos});
+        for (const Slot& slot : old_slots)
+            if (slot.index != npos)
+                InsertSlot(slot.addr, slot.index);
+    }
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+    unsigned bits = 0;
+};
+
+struct BufferReader {
+    llvm::ArrayRef<uint8_t> code;
+    uintptr_t code_addr;
+    size_t operator()(uintptr_t addr, uint8_t* buf, size_t size) {
+        if (addr < code_addr || addr - code_addr >= code.size())
+            return 0;
+        size = std::min(size, code.size() - (addr - code_addr));
+        std::memcpy(buf, code.data() + (addr - code_addr), size);
+        return size;
+    }
+};
 
-        size_t cur_block_start = insts.size();
+} // namespace
 
-        auto cur_addr_entry = addr_map.find(cur_addr);
-        while (cur_addr_entry == addr_map.end()) {
-            size_t inst_buf_sz = memacc(cur_addr, inst_buf, sizeof(inst_buf));
+int Function::Decode(uintptr_t addr, DecodeStop stop,
+                     RellumeMemAccessCb memacc, void* user_arg) {
+    if (!memacc) {
+        HostReader reader;
+        return DecodeImpl(addr, stop, reader);
+    }
+    CallbackReader reader{memacc, user_arg};
+    return DecodeImpl(addr, stop, reader);
+}
+
+int Function::Decode(uintptr_t addr, DecodeStop stop,
+                     llvm::ArrayRef<uint8_t> code, uintptr_t code_addr) {
+    BufferReader reader{code, code_addr};
+    return DecodeImpl(addr, stop, reader);
+}
+
+template<typename Reader>
+int Function::DecodeImpl(uintptr_t addr, DecodeStop stop, Reader& reader) {
+    uint8_t inst_buf[15];
+
+    // Addresses still to decode, processed in FIFO order.
+    std::vector<uintptr_t> worklist;
+    worklist.push_back(addr);
+
+    // Decoded instructions. Each run of sequentially decoded instructions is
+    // stored contiguously, so a block is a range of indices into insts.
+    std::vector<Instr> insts;
+    // Indices in insts where a block starts. A run start always starts a
+    // block; a jump into the middle of a run only adds a boundary here.
+    std::vector<size_t> block_starts;
+    // Mapping from address to instruction index.
+    AddrIndexMap addr_map;
+
+    for (size_t i = 0; i < worklist.size(); i++) {
+        uintptr_t cur_addr = worklist[i];
+        size_t run_start = insts.size();
+
+        size_t found_idx = addr_map.Find(cur_addr);
+        while (found_idx == AddrIndexMap::npos) {
+            size_t inst_buf_sz = reader(cur_addr, inst_buf, sizeof(inst_buf));
             // Sanity check.
             if (inst_buf_sz == 0 || inst_buf_sz > sizeof(inst_buf))
                 break;
 
+            Instr& inst = insts.emplace_back();
             int ret = fd_decode(inst_buf, inst_buf_sz, 64, /*addr=*/0, &inst);
             // If we reach an invalid instruction or an instruction we can't
             // decode, stop.
-            if (ret < 0)
+            if (ret < 0) {
+                insts.pop_back();
                 break;
+            }
             inst.address = cur_addr;
-
-            addr_map[cur_addr] = std::make_pair(blocks.size(), insts.size());
-            insts.push_back(inst);
+            addr_map.Insert(cur_addr, insts.size() - 1);
 
             if (stop == DecodeStop::INSTR)
                 break;
@@ -116,40 +220,46 @@ int Function::Decode(uintptr_t addr, DecodeStop stop, MemReader memacc) {
                     break;
 
                 // If we want explicit call/ret semantics, assume that a call
-                // actually returns to the same place.
-                if (breaks_cond ||
+                // actually returns to the same place. The same holds for
+                // calls to native functions.
+                bool native_call = inst.type() == FDI_CALL &&
+                                   inst.op(0).is_pcrel() &&
+                                   cfg->native_calls.count(inst.end() +
+                                                           inst.op(0).pcrel());
+                if (breaks_cond || native_call ||
                     (inst.type() == FDI_CALL && cfg->call_function))
-                    addr_queue.push_back(cur_addr + inst.len());
+                    worklist.push_back(cur_addr + inst.len());
                 if (has_jmp_target && inst.type() != FDI_CALL &&
                     inst.op(0).is_pcrel())
-                    addr_queue.push_back(inst.end() + inst.op(0).pcrel());
+                    worklist.push_back(inst.end() + inst.op(0).pcrel());
                 break;
             }
             cur_addr += inst.len();
-            cur_addr_entry = addr_map.find(cur_addr);
+            found_idx = addr_map.Find(cur_addr);
         }
 
-        if (insts.size() != cur_block_start)
-            blocks.push_back(std::make_pair(cur_block_start, insts.size()));
-
-        if (cur_addr_entry != addr_map.end()) {
-            auto& other_blk = blocks[cur_addr_entry->second.first];
-            size_t split_idx = cur_addr_entry->second.second;
-            if (other_blk.first == split_idx)
-                continue;
-            size_t end = other_blk.second;
-            blocks.push_back(std::make_pair(split_idx, end));
-            blocks[cur_addr_entry->second.first].second = split_idx;
-            size_t new_block_idx = blocks.size() - 1;
-            for (size_t j = split_idx; j < end; j++)
-                addr_map[insts[j].start()] = std::make_pair(new_block_idx, j);
-        }
+        if (insts.size() != run_start)
+            block_starts.push_back(run_start);
+        // Jumping into an existing block splits it at the target.
+        if (found_idx != AddrIndexMap::npos)
+            block_starts.push_back(found_idx);
     }
 
+    // If we didn't decode a single instruction, return error code.
+    if (insts.empty())
+        return 1;
+
+    // Blocks are the intervals between consecutive starts; runs are stored
+    // in order, so the end of a run is always the start of the next block.
+    std::sort(block_starts.begin(), block_starts.end());
+    block_starts.erase(std::unique(block_starts.begin(), block_starts.end()),
+                       block_starts.end());
+    block_starts.push_back(insts.size());
+
     bool first_inst = true;
-    for (auto it = blocks.begin(); it != blocks.end(); it++) {
-        uint64_t block_addr = insts[it->first].start();
-        for (size_t j = it->first; j < it->second; j++) {
+    for (size_t i = 0; i + 1 < block_starts.size(); i++) {
+        uint64_t block_addr = insts[block_starts[i]].start();
+        for (size_t j = block_starts[i]; j < block_starts[i + 1]; j++) {
             if (!AddInst(block_addr, insts[j])) {
                 // If we fail on the first instruction, propagate error.
                 if (first_inst)
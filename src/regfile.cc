@@ -62,6 +62,10 @@ unsigned RegisterSetBitIdx(X86Reg reg, Facet facet) {
         // clang-format on
     case X86Reg::RegKind::VEC:
         return 24 + reg.Index();
+    case X86Reg::RegKind::SEGBASE:
+        return 40 + reg.Index();
+    case X86Reg::RegKind::X87:
+        return 42 + reg.Index();
     default:
         assert(false && "invalid register kind");
     }
@@ -99,6 +103,8 @@ public:
         }
         return static_cast<llvm::Value*>(values[0]);
     }
+    bool pending() const { return generator != nullptr; }
+    void* pending_data(Generator gen) { return generator == gen ? values : nullptr; }
     explicit operator bool() const { return generator || values[0]; }
 };
 
@@ -116,6 +122,14 @@ public:
                       "defer arg type misaligned");
         *reinterpret_cast<T*>(values) = data;
     }
+
+    /// Get the data of a value which is still pending with the given
+    /// generator, or nullptr otherwise.
+    static T* PendingData(DeferredValueBase& value, Generator generator) {
+        auto base_generator =
+            reinterpret_cast<DeferredValueBase::Generator>(generator);
+        return reinterpret_cast<T*>(value.pending_data(base_generator));
+    }
 };
 
 template<typename R, Facet::Value... E>
@@ -175,20 +189,28 @@ using ValueMapSse = ValueMap<R, Facet::I128,
 template<typename R>
 using ValueMapFlags = ValueMap<R, Facet::ZF, Facet::SF, Facet::PF, Facet::CF, Facet::OF, Facet::AF, Facet::DF>;
 
+template<typename R>
+using ValueMapX87 = ValueMap<R, Facet::F80, Facet::F64>;
+
 
 class RegFile::impl {
 public:
     impl() : insert_block(nullptr), regs_gp{}, regs_sse{}, reg_ip(), flags(),
-             dirty_regs(), cleaned_regs() {}
+             regs_seg(), regs_x87{}, dirty_regs(), cleaned_regs() {}
 
     llvm::BasicBlock* GetInsertBlock() { return insert_block; }
     void SetInsertBlock(llvm::BasicBlock* n) { insert_block = n; }
 
     void Clear();
-    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets);
+    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets, bool weak);
 
-    llvm::Value* GetReg(X86Reg reg, Facet facet);
+    llvm::Value* GetReg(X86Reg reg, Facet facet, bool weak_phis = true);
+    llvm::Value* GetRegFacet(X86Reg reg, Facet facet, bool weak_phis = true);
+    llvm::Value* GetRegFacetValue(X86Reg reg, Facet facet);
     void SetReg(X86Reg reg, Facet facet, llvm::Value*, bool clear_facets);
+    void SetRegLoad(X86Reg reg, Facet facet, llvm::Value* ptr);
+    void SetRegScalar(X86Reg reg, llvm::Value* value);
+    void AdjustX87Top(int delta);
 
     RegisterSet& DirtyRegs() { return dirty_regs; }
     RegisterSet& CleanedRegs() { return cleaned_regs; }
@@ -199,12 +221,21 @@ private:
     ValueMapSse<DeferredValueBase> regs_sse[16];
     DeferredValueBase reg_ip;
     ValueMapFlags<DeferredValueBase> flags;
+    DeferredValueBase regs_seg[2];
+    /// x87 registers in the order of the stack at the beginning of the block,
+    /// ST(i) is stored in regs_x87[(x87_top + i) % 8].
+    ValueMapX87<DeferredValueBase> regs_x87[8];
+    unsigned x87_top = 0;
 
     RegisterSet dirty_regs;
     RegisterSet cleaned_regs;
+    // Whether PHIs of non-native facets are only created on direct request.
+    bool weak_facets = false;
 
+    unsigned X87Slot(X86Reg reg) const {
+        return (x87_top + reg.Index()) % 8;
+    }
     DeferredValueBase* AccessRegFacet(X86Reg reg, Facet facet);
-    llvm::Value* GetRegFacet(X86Reg reg, Facet facet);
 };
 
 void RegFile::impl::Clear() {
@@ -214,10 +245,16 @@ void RegFile::impl::Clear() {
         regs_sse[i].clear();
     flags.clear();
     reg_ip = nullptr;
+    for (auto& reg : regs_seg)
+        reg = nullptr;
+    for (auto& reg : regs_x87)
+        reg.clear();
+    x87_top = 0;
 }
 
 void RegFile::impl::InitWithPHIs(std::vector<PhiDesc>* desc_vec,
-                                 bool all_facets) {
+                                 bool all_facets, bool weak) {
+    weak_facets = all_facets && weak;
     auto fn = [desc_vec](Facet) {
         using DeferData = std::vector<PhiDesc>*;
         return DeferredValue<DeferData>(
@@ -236,15 +273,21 @@ void RegFile::impl::InitWithPHIs(std::vector<PhiDesc>* desc_vec,
             reg.setAll(fn);
         for (auto& reg : regs_sse)
             reg.setAll(fn);
+        for (auto& reg : regs_x87)
+            reg.setAll(fn);
     } else {
         for (auto& reg : regs_gp)
             reg[Facet::I64] = fn(Facet::I64);
         for (auto& reg : regs_sse)
             reg[Facet::IVEC] = fn(Facet::IVEC);
+        for (auto& reg : regs_x87)
+            reg[Facet::F80] = fn(Facet::F80);
     }
 
     flags.setAll(fn);
     reg_ip = fn(Facet::I64);
+    for (auto& reg : regs_seg)
+        reg = fn(Facet::I64);
 }
 
 DeferredValueBase* RegFile::impl::AccessRegFacet(X86Reg reg, Facet facet) {
@@ -266,22 +309,51 @@ DeferredValueBase* RegFile::impl::AccessRegFacet(X86Reg reg, Facet facet) {
         if (regs_sse[idx].has(facet))
             return &regs_sse[idx][facet];
         return nullptr;
+    case X86Reg::RegKind::SEGBASE:
+        if (facet == Facet::I64)
+            return &regs_seg[idx];
+        return nullptr;
+    case X86Reg::RegKind::X87:
+        if (regs_x87[X87Slot(reg)].has(facet))
+            return &regs_x87[X87Slot(reg)][facet];
+        return nullptr;
     default:
         return nullptr;
     }
 }
 
-llvm::Value* RegFile::impl::GetRegFacet(X86Reg reg, Facet facet) {
+llvm::Value* RegFile::impl::GetRegFacet(X86Reg reg, Facet facet,
+                                        bool weak_phis) {
     DeferredValueBase* def_val = AccessRegFacet(reg, facet);
-    if (def_val)
-        return def_val->get(reg, facet, insert_block);
-    return nullptr;
+    if (!def_val)
+        return nullptr;
+    // Weak PHIs of non-native facets are only created on direct request, for
+    // derived facets and predecessors the native facet is used instead.
+    if (!weak_phis && weak_facets && def_val->pending()) {
+        bool native = facet == Facet::I64 ||
+                      (reg.Kind() == X86Reg::RegKind::VEC && facet == Facet::IVEC) ||
+                      (reg.Kind() == X86Reg::RegKind::X87 && facet == Facet::F80);
+        if (!native && reg.Kind() != X86Reg::RegKind::EFLAGS)
+            return nullptr;
+    }
+    // Pending PHIs of x87 registers refer to the stack at the block entry.
+    if (reg.Kind() == X86Reg::RegKind::X87)
+        reg = X86Reg::X87(X87Slot(reg));
+    return def_val->get(reg, facet, insert_block);
+}
+
+llvm::Value* RegFile::impl::GetRegFacetValue(X86Reg reg, Facet facet) {
+    // Don't materialize pending values, e.g. to avoid creating PHI nodes.
+    DeferredValueBase* def_val = AccessRegFacet(reg, facet);
+    if (!def_val || def_val->pending())
+        return nullptr;
+    return def_val->get(reg, facet, insert_block);
 }
 
-llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
+llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet, bool weak_phis) {
     // If we store the selected facet in our register file and the facet is
     // valid, return it immediately.
-    if (llvm::Value* res = GetRegFacet(reg, facet))
+    if (llvm::Value* res = GetRegFacet(reg, facet, weak_phis))
         return res;
 
     llvm::IRBuilder<> irb(insert_block);
@@ -318,14 +390,15 @@ llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
         if (DeferredValueBase* facet_entry = AccessRegFacet(reg, facet))
             *facet_entry = res;
         return res;
-    } else if (reg.Kind() == X86Reg::RegKind::IP) {
+    } else if (reg.Kind() == X86Reg::RegKind::IP ||
+               reg.Kind() == X86Reg::RegKind::SEGBASE) {
         llvm::Value* native = GetRegFacet(reg, Facet::I64);
         if (facet == Facet::I64)
             return native;
         else if (facet == Facet::PTR)
             return irb.CreateIntToPtr(native, irb.getInt8PtrTy());
         else
-            assert(false && "invalid facet for ip-reg");
+            assert(false && "invalid facet for ip/segment-reg");
     } else if (reg.Kind() == X86Reg::RegKind::VEC) {
         llvm::Value* res = nullptr;
         llvm::Value* native = GetRegFacet(reg, Facet::IVEC);
@@ -335,22 +408,28 @@ llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
             res = irb.CreateTrunc(native, facetType);
             break;
         case Facet::I8:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V16I8), int{0});
+            res = GetReg(reg, Facet::V16I8, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::I16:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V8I16), int{0});
+            res = GetReg(reg, Facet::V8I16, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::I32:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V4I32), int{0});
+            res = GetReg(reg, Facet::V4I32, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::I64:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V2I64), int{0});
+            res = GetReg(reg, Facet::V2I64, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::F32:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V4F32), int{0});
+            res = GetReg(reg, Facet::V4F32, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::F64:
-            res = irb.CreateExtractElement(GetReg(reg, Facet::V2F64), int{0});
+            res = GetReg(reg, Facet::V2F64, /*weak_phis=*/false);
+            res = irb.CreateExtractElement(res, int{0});
             break;
         case Facet::V1I8:
         case Facet::V2I8:
@@ -376,7 +455,8 @@ llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
 
             // Prefer 128-bit SSE facet over full vector register.
             if (facetType->getPrimitiveSizeInBits() <= 128)
-                if (llvm::Value* value_128 = GetRegFacet(reg, Facet::I128))
+                if (llvm::Value* value_128 = GetRegFacet(reg, Facet::I128,
+                                                        /*weak_phis=*/false))
                     native = value_128;
 
             int elementBits = elem_ty->getPrimitiveSizeInBits();
@@ -405,6 +485,24 @@ llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
         if (DeferredValueBase* facet_entry = AccessRegFacet(reg, facet))
             *facet_entry = res;
         return res;
+    } else if (reg.Kind() == X86Reg::RegKind::X87) {
+        // The register holds either the 80-bit facet or, when computing with
+        // double precision, only the double facet.
+        llvm::Value* res = nullptr;
+        if (facet == Facet::F64) {
+            llvm::Value* native = GetRegFacet(reg, Facet::F80);
+            assert(native && "native x87-reg facet is null");
+            res = irb.CreateFPTrunc(native, facetType);
+        } else if (facet == Facet::F80) {
+            llvm::Value* value_64 = GetRegFacet(reg, Facet::F64);
+            assert(value_64 && "x87-reg has no facet");
+            res = irb.CreateFPExt(value_64, facetType);
+        } else {
+            assert(false && "invalid facet for x87-reg");
+        }
+
+        *AccessRegFacet(reg, facet) = res;
+        return res;
     } else {
         assert(false && "GetReg with invalid register kind");
     }
@@ -412,6 +510,88 @@ llvm::Value* RegFile::impl::GetReg(X86Reg reg, Facet facet) {
     return nullptr;
 }
 
+void RegFile::impl::SetRegLoad(X86Reg reg, Facet facet, llvm::Value* ptr) {
+    // The load is emitted when the value is first requested, at the end of
+    // the block. This is fine as long as the memory is not modified in the
+    // meantime, which holds for the CPU struct between calls.
+    DeferredValueBase* facet_entry = AccessRegFacet(reg, facet);
+    assert(facet_entry && "attempt to store invalid facet");
+    *facet_entry = DeferredValue<llvm::Value*>(
+        [](X86Reg reg, Facet facet, llvm::BasicBlock* bb, llvm::Value** ptr) {
+            llvm::IRBuilder<> irb(bb);
+            if (llvm::Instruction* terminator = bb->getTerminator())
+                irb.SetInsertPoint(terminator);
+            return llvm::cast<llvm::Value>(irb.CreateLoad(*ptr));
+        },
+        ptr);
+}
+
+namespace {
+
+struct ScalarInsert {
+    llvm::Value* base;
+    llvm::Value* scalar;
+
+    static llvm::Value* Generate(X86Reg reg, Facet facet, llvm::BasicBlock* bb,
+                                 ScalarInsert* data) {
+        llvm::IRBuilder<> irb(bb);
+        if (llvm::Instruction* terminator = bb->getTerminator())
+            irb.SetInsertPoint(terminator);
+        llvm::Type* ivec_ty = data->base->getType();
+        llvm::Type* elem_ty = data->scalar->getType();
+        unsigned num = ivec_ty->getPrimitiveSizeInBits() /
+                       elem_ty->getPrimitiveSizeInBits();
+        llvm::Type* full_ty = llvm::VectorType::get(elem_ty, num);
+        llvm::Value* full = irb.CreateBitCast(data->base, full_ty);
+        full = irb.CreateInsertElement(full, data->scalar, 0ul);
+        return irb.CreateBitCast(full, ivec_ty);
+    }
+};
+
+} // namespace
+
+void RegFile::impl::SetRegScalar(X86Reg reg, llvm::Value* value) {
+    assert(reg.Kind() == X86Reg::RegKind::VEC);
+    Facet facet = Facet::FromType(value->getType());
+    DeferredValueBase& ivec_entry = regs_sse[reg.Index()][Facet::IVEC];
+
+    // Keep the vector before the first of a sequence of scalar writes as base
+    // and assemble the full vector only when it is actually requested. This
+    // is only possible if the new scalar overwrites the pending one entirely,
+    // otherwise the upper part of the pending scalar must be kept.
+    llvm::Value* base;
+    using DeferredInsert = DeferredValue<ScalarInsert>;
+    auto* pending = DeferredInsert::PendingData(ivec_entry,
+                                                ScalarInsert::Generate);
+    unsigned bits = value->getType()->getPrimitiveSizeInBits();
+    if (pending && bits >= pending->scalar->getType()->getPrimitiveSizeInBits())
+        base = pending->base;
+    else
+        base = GetReg(reg, Facet::IVEC);
+
+    // The register file must not keep a reference to an empty PHI node, which
+    // could be erased when it is unused otherwise.
+    llvm::IRBuilder<> irb(insert_block);
+    if (llvm::isa<llvm::PHINode>(base))
+        base = irb.CreateUnaryIntrinsic(llvm::Intrinsic::ssa_copy, base);
+    if (llvm::isa<llvm::PHINode>(value))
+        value = irb.CreateUnaryIntrinsic(llvm::Intrinsic::ssa_copy, value);
+
+    regs_sse[reg.Index()].clear();
+    ivec_entry = DeferredValue<ScalarInsert>(ScalarInsert::Generate,
+                                             ScalarInsert{base, value});
+    regs_sse[reg.Index()][facet] = value;
+
+    dirty_regs[RegisterSetBitIdx(reg, Facet::IVEC)] = true;
+}
+
+void RegFile::impl::AdjustX87Top(int delta) {
+    x87_top = (x87_top + 8 + delta) % 8;
+    // All stack-relative registers now refer to different values.
+    for (unsigned i = 0; i < 8; i++)
+        dirty_regs[RegisterSetBitIdx(X86Reg::X87(i), Facet::F80)] = true;
+}
+
 void RegFile::impl::SetReg(X86Reg reg, Facet facet, llvm::Value* value,
                            bool clearOthers) {
     if (facet == Facet::PTR)
@@ -426,6 +606,8 @@ void RegFile::impl::SetReg(X86Reg reg, Facet facet, llvm::Value* value,
         } else if (reg.Kind() == X86Reg::RegKind::VEC) {
             assert(facet == Facet::IVEC);
             regs_sse[reg.Index()].clear();
+        } else if (reg.Kind() == X86Reg::RegKind::X87) {
+            regs_x87[X87Slot(reg)].clear();
         }
     }
 
@@ -449,13 +631,26 @@ RegFile::~RegFile() {}
 llvm::BasicBlock* RegFile::GetInsertBlock() { return pimpl->GetInsertBlock(); }
 void RegFile::SetInsertBlock(llvm::BasicBlock* n) { pimpl->SetInsertBlock(n); }
 void RegFile::Clear() { pimpl->Clear(); }
-void RegFile::InitWithPHIs(std::vector<PhiDesc>* desc_vec, bool all_facets) {
-    pimpl->InitWithPHIs(desc_vec, all_facets);
+void RegFile::InitWithPHIs(std::vector<PhiDesc>* desc_vec, bool all_facets,
+                           bool weak) {
+    pimpl->InitWithPHIs(desc_vec, all_facets, weak);
+}
+llvm::Value* RegFile::GetReg(X86Reg r, Facet f, bool weak_phis) {
+    return pimpl->GetReg(r, f, weak_phis);
+}
+llvm::Value* RegFile::GetRegFacet(X86Reg reg, Facet facet) {
+    return pimpl->GetRegFacetValue(reg, facet);
 }
-llvm::Value* RegFile::GetReg(X86Reg r, Facet f) { return pimpl->GetReg(r, f); }
 void RegFile::SetReg(X86Reg reg, Facet facet, llvm::Value* value, bool clear) {
     pimpl->SetReg(reg, facet, value, clear);
 }
+void RegFile::SetRegLoad(X86Reg reg, Facet facet, llvm::Value* ptr) {
+    pimpl->SetRegLoad(reg, facet, ptr);
+}
+void RegFile::SetRegScalar(X86Reg reg, llvm::Value* value) {
+    pimpl->SetRegScalar(reg, value);
+}
+void RegFile::AdjustX87Top(int delta) { pimpl->AdjustX87Top(delta); }
 RegisterSet& RegFile::DirtyRegs() { return pimpl->DirtyRegs(); }
 RegisterSet& RegFile::CleanedRegs() { return pimpl->CleanedRegs(); }
 
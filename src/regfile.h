@@ -43,6 +43,8 @@ public:
         IP,     // 64-bit
         EFLAGS, // 7 x 1-bit
         VEC,    // >= 128-bit
+        SEGBASE, // 64-bit, FS=0, GS=1
+        X87,    // 80-bit, index relative to the top of stack
     };
 
 private:
@@ -72,9 +74,13 @@ public:
     static constexpr X86Reg VEC(unsigned idx) {
         return X86Reg(RegKind::VEC, idx);
     }
+    static constexpr X86Reg X87(unsigned idx) {
+        return X86Reg(RegKind::X87, idx);
+    }
     static const X86Reg RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI;
     static const X86Reg IP;
     static const X86Reg EFLAGS;
+    static const X86Reg FSBASE, GSBASE;
 };
 
 constexpr const X86Reg X86Reg::RAX = X86Reg::GP(0);
@@ -87,8 +93,10 @@ constexpr const X86Reg X86Reg::RSI = X86Reg::GP(6);
 constexpr const X86Reg X86Reg::RDI = X86Reg::GP(7);
 constexpr const X86Reg X86Reg::IP{X86Reg::RegKind::IP, 0};
 constexpr const X86Reg X86Reg::EFLAGS{X86Reg::RegKind::EFLAGS, 0};
+constexpr const X86Reg X86Reg::FSBASE{X86Reg::RegKind::SEGBASE, 0};
+constexpr const X86Reg X86Reg::GSBASE{X86Reg::RegKind::SEGBASE, 1};
 
-using RegisterSet = std::bitset<40>;
+using RegisterSet = std::bitset<50>;
 unsigned RegisterSetBitIdx(X86Reg reg, Facet facet);
 
 class RegFile {
@@ -107,10 +115,28 @@ public:
 
     void Clear();
     using PhiDesc = std::tuple<X86Reg, Facet, llvm::PHINode*>;
-    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets);
-
-    llvm::Value* GetReg(X86Reg reg, Facet facet);
+    /// Initialize all registers with PHI nodes created on demand. If weak is
+    /// set, PHIs of non-native facets are only created when the facet is read
+    /// directly by GetReg and not when it is derived from another facet.
+    void InitWithPHIs(std::vector<PhiDesc>*, bool all_facets, bool weak);
+
+    /// Get a facet of a register. If weak_phis is false, facets for which no
+    /// PHI node was created yet are derived from the native facet instead.
+    llvm::Value* GetReg(X86Reg reg, Facet facet, bool weak_phis = true);
+    /// Get a facet only if its value is currently stored, without deriving it
+    /// from other facets or creating a pending PHI node. Returns nullptr
+    /// otherwise.
+    llvm::Value* GetRegFacet(X86Reg reg, Facet facet);
     void SetReg(X86Reg reg, Facet facet, llvm::Value*, bool clear_facets);
+    void SetRegLoad(X86Reg reg, Facet facet, llvm::Value* ptr);
+    /// Set the lowest element of a vector register to a scalar value, leaving
+    /// the other elements unchanged. The full vector is assembled only when a
+    /// facet other than the scalar one is requested.
+    void SetRegScalar(X86Reg reg, llvm::Value* value);
+    /// Move the x87 top of stack by delta registers, i.e. -1 for a push and
+    /// +1 for a pop. Only the mapping of stack-relative registers changes, so
+    /// the stack depth is tracked statically and no code is emitted.
+    void AdjustX87Top(int delta);
 
     RegisterSet& DirtyRegs();
     RegisterSet& CleanedRegs();
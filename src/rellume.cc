@@ -23,10 +23,12 @@
 
 #include "rellume/rellume.h"
 
+#include "blockcache.h"
 #include "callconv.h"
 #include "config.h"
 #include "function.h"
 #include "instr.h"
+#include "stackmap.h"
 #include "transforms.h"
 
 #include <llvm-c/Core.h>
@@ -35,8 +37,10 @@
 
 #include <fadec.h>
 
+#include <algorithm>
 #include <cstdbool>
 #include <cstdint>
+#include <vector>
 
 namespace {
 static rellume::LLConfig* unwrap(LLConfig* fn) {
@@ -45,6 +49,9 @@ static rellume::LLConfig* unwrap(LLConfig* fn) {
 static rellume::Function* unwrap(LLFunc* fn) {
     return reinterpret_cast<rellume::Function*>(fn);
 }
+static rellume::BlockCache* unwrap(LLBlockCache* cache) {
+    return reinterpret_cast<rellume::BlockCache*>(cache);
+}
 } // namespace
 
 LLConfig* ll_config_new(void) {
@@ -55,6 +62,10 @@ void ll_config_set_hhvm(LLConfig* cfg, bool hhvm) {
     rellume::LLConfig* rlcfg = unwrap(cfg);
     rlcfg->callconv = hhvm ? rellume::CallConv::HHVM : rellume::CallConv::SPTR;
 }
+void ll_config_set_regcall(LLConfig* cfg, unsigned vec_regs) {
+    unwrap(cfg)->callconv = rellume::CallConv(rellume::CallConv::REGCALL,
+                                              vec_regs < 16 ? vec_regs : 16);
+}
 void ll_config_set_sptr_addrspace(LLConfig* cfg, unsigned addrspace) {
     unwrap(cfg)->sptr_addrspace = addrspace;
 }
@@ -64,6 +75,9 @@ void ll_config_enable_overflow_intrinsics(LLConfig* cfg, bool enable) {
 void ll_config_enable_fast_math(LLConfig* cfg, bool enable) {
     unwrap(cfg)->enableFastMath = enable;
 }
+void ll_config_enable_x87_double(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->x87_double = enable;
+}
 void ll_config_enable_verify_ir(LLConfig* cfg, bool enable) {
     unwrap(cfg)->verify_ir = enable;
 }
@@ -75,6 +89,17 @@ void ll_config_set_global_base(LLConfig* cfg, uintptr_t base,
     unwrap(cfg)->global_base_addr = base;
     unwrap(cfg)->global_base_value = llvm::unwrap(value);
 }
+void ll_config_set_sandbox(LLConfig* cfg, LLVMValueRef base, uint64_t mask) {
+    unwrap(cfg)->sandbox_base = llvm::unwrap(base);
+    unwrap(cfg)->sandbox_mask = mask;
+}
+void ll_config_set_tlb(LLConfig* cfg, LLVMValueRef tlb, unsigned bits,
+                       unsigned page_bits, LLVMValueRef miss_fn) {
+    unwrap(cfg)->tlb = llvm::unwrap(tlb);
+    unwrap(cfg)->tlb_miss_function = llvm::unwrap<llvm::Function>(miss_fn);
+    unwrap(cfg)->tlb_bits = bits;
+    unwrap(cfg)->tlb_page_bits = page_bits;
+}
 void ll_config_set_instr_impl(LLConfig* cfg, FdInstrType type,
                               LLVMValueRef value) {
     unwrap(cfg)->instr_overrides[type] = llvm::unwrap<llvm::Function>(value);
@@ -87,6 +112,20 @@ void ll_config_set_call_func(LLConfig* cfg, LLVMValueRef value) {
     llvm::Value* uw_value = llvm::unwrap(value);
     unwrap(cfg)->call_function = llvm::cast_or_null<llvm::Function>(uw_value);
 }
+void ll_config_set_native_call(LLConfig* cfg, uint64_t addr,
+                               LLVMValueRef value) {
+    if (value)
+        unwrap(cfg)->native_calls[addr] = llvm::unwrap<llvm::Function>(value);
+    else
+        unwrap(cfg)->native_calls.erase(addr);
+}
+void ll_config_set_shadow_ret_stack(LLConfig* cfg, LLVMValueRef stack,
+                                    LLVMValueRef mismatch_fn) {
+    unwrap(cfg)->shadow_ret_stack = llvm::unwrap(stack);
+    llvm::Value* uw_mismatch_fn = llvm::unwrap(mismatch_fn);
+    unwrap(cfg)->shadow_ret_stack_mismatch =
+        llvm::cast_or_null<llvm::Function>(uw_mismatch_fn);
+}
 void ll_config_set_syscall_impl(LLConfig* cfg, LLVMValueRef value) {
     unwrap(cfg)->syscall_implementation = llvm::unwrap<llvm::Function>(value);
 }
@@ -96,6 +135,13 @@ void ll_config_set_instr_marker(LLConfig* cfg, LLVMValueRef value) {
     else
         unwrap(cfg)->instr_marker = nullptr;
 }
+void ll_config_set_edge_coverage(LLConfig* cfg, LLVMValueRef map,
+                                 unsigned map_bits, LLVMValueRef prev_loc) {
+    unwrap(cfg)->coverage_map = llvm::unwrap(map);
+    // Larger maps make no sense and the mask computation would overflow.
+    unwrap(cfg)->coverage_map_bits = std::min(map_bits, 32u);
+    unwrap(cfg)->coverage_prev_loc = llvm::unwrap(prev_loc);
+}
 void ll_config_set_call_ret_clobber_flags(LLConfig* cfg, bool enable) {
     unwrap(cfg)->call_ret_clobber_flags = enable;
 }
@@ -105,6 +151,18 @@ void ll_config_set_use_native_segment_base(LLConfig* cfg, bool enable) {
 void ll_config_enable_full_facets(LLConfig* cfg, bool enable) {
     unwrap(cfg)->full_facets = enable;
 }
+void ll_config_enable_adaptive_facets(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->adaptive_facets = enable;
+}
+void ll_config_enable_string_libcalls(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->string_libcalls = enable;
+}
+void ll_config_enable_rip_stackmaps(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->rip_stackmaps = enable;
+}
+void ll_config_enable_abi_stack_alignment(LLConfig* cfg, bool enable) {
+    unwrap(cfg)->abi_stack_alignment = enable;
+}
 
 // Rellume Function API
 
@@ -122,18 +180,7 @@ void ll_func_dispose(LLFunc* fn) { delete unwrap(fn); }
 static int ll_func_decode(LLFunc* func, uintptr_t addr,
                           rellume::Function::DecodeStop stop,
                           RellumeMemAccessCb mem_acc, void* user_arg) {
-    rellume::Function::MemReader rl_memacc;
-    if (mem_acc) {
-        rl_memacc = [=](uintptr_t maddr, uint8_t* buf, size_t buf_sz) {
-            return mem_acc(maddr, buf, buf_sz, user_arg);
-        };
-    } else {
-        rl_memacc = [](uintptr_t mem_addr, uint8_t* buf, size_t buf_sz) {
-            memcpy(buf, reinterpret_cast<uint8_t*>(mem_addr), buf_sz);
-            return buf_sz;
-        };
-    }
-    return unwrap(func)->Decode(addr, stop, rl_memacc);
+    return unwrap(func)->Decode(addr, stop, mem_acc, user_arg);
 }
 int ll_func_decode_instr(LLFunc* func, uintptr_t addr,
                          RellumeMemAccessCb mem_acc, void* user_arg) {
@@ -151,6 +198,31 @@ int ll_func_decode_cfg(LLFunc* func, uintptr_t addr, RellumeMemAccessCb mem_acc,
                           mem_acc, user_arg);
 }
 
+// Copy the histogram sorted by descending count, return the number of entries.
+static size_t ll_copy_unsupported(const rellume::UnsupportedHistogram& hist,
+                                  LLUnsupportedInstr* buf, size_t size) {
+    std::vector<LLUnsupportedInstr> entries;
+    for (const auto& [type, entry] : hist)
+        entries.push_back(LLUnsupportedInstr{static_cast<FdInstrType>(type),
+                                             entry.count, entry.first_addr});
+    std::stable_sort(entries.begin(), entries.end(),
+                     [] (const auto& lhs, const auto& rhs) {
+        return lhs.count > rhs.count;
+    });
+    std::copy_n(entries.begin(), std::min(size, entries.size()), buf);
+    return entries.size();
+}
+size_t ll_func_unsupported_instrs(LLFunc* func, LLUnsupportedInstr* buf,
+                                  size_t size) {
+    return ll_copy_unsupported(unwrap(func)->UnsupportedInstrs(), buf, size);
+}
+size_t ll_unsupported_instrs(LLUnsupportedInstr* buf, size_t size) {
+    return ll_copy_unsupported(rellume::GlobalUnsupportedInstrs(), buf, size);
+}
+void ll_unsupported_instrs_reset(void) {
+    rellume::ResetGlobalUnsupportedInstrs();
+}
+
 void ll_func_fast_opt(LLVMValueRef llvm_fn) {
     rellume::FastOpt(llvm::unwrap<llvm::Function>(llvm_fn));
 }
@@ -160,3 +232,57 @@ LLVMValueRef ll_func_wrap_sysv(LLVMValueRef fn, LLVMTypeRef ty,
                                            llvm::unwrap<llvm::FunctionType>(ty),
                                            stack_sz));
 }
+
+// Rellume Block Cache API
+
+LLBlockCache* ll_block_cache_new(LLConfig* cfg, LLVMContextRef ctx,
+                                 LLBlockCacheCompileCb cb, void* user_arg) {
+    return reinterpret_cast<LLBlockCache*>(
+        new rellume::BlockCache(unwrap(cfg), *llvm::unwrap(ctx), cb, user_arg));
+}
+void ll_block_cache_dispose(LLBlockCache* cache) { delete unwrap(cache); }
+void* ll_block_cache_lookup(LLBlockCache* cache, uint64_t addr) {
+    return unwrap(cache)->Lookup(addr);
+}
+int ll_block_cache_add(LLBlockCache* cache, uint64_t addr,
+                       RellumeMemAccessCb mem_acc, void* user_arg) {
+    return unwrap(cache)->Add(addr, mem_acc, user_arg) ? 0 : 1;
+}
+int ll_block_cache_flush(LLBlockCache* cache) {
+    return unwrap(cache)->Flush() ? 0 : 1;
+}
+void* ll_block_cache_translate(LLBlockCache* cache, uint64_t addr,
+                               RellumeMemAccessCb mem_acc, void* user_arg) {
+    if (void* code = unwrap(cache)->Lookup(addr))
+        return code;
+    if (!unwrap(cache)->Add(addr, mem_acc, user_arg))
+        return nullptr;
+    unwrap(cache)->Flush();
+    return unwrap(cache)->Lookup(addr);
+}
+void ll_block_cache_invalidate(LLBlockCache* cache, uint64_t start,
+                               uint64_t end) {
+    unwrap(cache)->Invalidate(start, end);
+}
+
+uint64_t ll_stackmap_lookup(const void* stackmaps, size_t size,
+                            uintptr_t host_pc) {
+    auto data = static_cast<const uint8_t*>(stackmaps);
+    return rellume::StackMapLookup(data, size, host_pc);
+}
+
+// Rellume C++ API
+
+namespace rellume {
+
+int Decode(Function* fn, uintptr_t addr, DecodeStop stop,
+           RellumeMemAccessCb cb, void* user_arg) {
+    return fn->Decode(addr, stop, cb, user_arg);
+}
+int Decode(Function* fn, uintptr_t addr, DecodeStop stop,
+           llvm::ArrayRef<uint8_t> code, uintptr_t code_addr) {
+    return fn->Decode(addr, stop, code, code_addr);
+}
+llvm::Function* Lift(Function* fn) { return fn->Lift(); }
+
+} // namespace rellume
@@ -0,0 +1,126 @@
+/**
+ * This file is part of Rellume.
+ *
+ * (c) 2019, Alexis Engelke <alexis.engelke@googlemail.com>
+ *
+ * Rellume is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Rellume is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Rellume.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file
+ **/
+
+#include "stackmap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace rellume {
+
+namespace {
+
+/// Minimal reader for the LLVM stack map format, version 3.
+class StackMapReader {
+    const uint8_t* data;
+    std::size_t size;
+
+public:
+    StackMapReader(const uint8_t* data, std::size_t size)
+        : data(data), size(size) {}
+
+    template<typename T>
+    bool Read(std::size_t off, T& val) const {
+        if (off > size || size - off < sizeof(T))
+            return false;
+        std::memcpy(&val, data + off, sizeof(T));
+        return true;
+    }
+};
+
+std::size_t Align8(std::size_t off) {
+    return (off + 7) & ~std::size_t{7};
+}
+
+} // namespace
+
+/// Find the guest instruction address for a host program counter inside
+/// lifted code. The stack map IDs are guest addresses, the record preceding
+/// the program counter in the function containing it is the result. Returns
+/// zero if there is no such record.
+uint64_t StackMapLookup(const uint8_t* data, std::size_t size, uintptr_t pc) {
+    StackMapReader reader(data, size);
+
+    uint8_t version;
+    uint32_t num_fns, num_consts, num_records;
+    if (!reader.Read(0, version) || version != 3)
+        return 0;
+    if (!reader.Read(4, num_fns) || !reader.Read(8, num_consts) ||
+        !reader.Read(12, num_records))
+        return 0;
+
+    // Functions have no size, so assume that the function with the highest
+    // address not above pc contains it.
+    const std::size_t fn_base = 16;
+    bool fn_found = false;
+    uint64_t fn_addr = 0;
+    for (uint32_t i = 0; i < num_fns; i++) {
+        uint64_t addr;
+        if (!reader.Read(fn_base + 24 * i, addr))
+            return 0;
+        if (addr <= pc && (!fn_found || addr > fn_addr)) {
+            fn_addr = addr;
+            fn_found = true;
+        }
+    }
+    if (!fn_found)
+        return 0;
+
+    uint64_t result = 0;
+    uint32_t best_off = 0;
+    std::size_t rec_off = fn_base + 24 * std::size_t{num_fns} +
+                          8 * std::size_t{num_consts};
+    for (uint32_t i = 0; i < num_fns; i++) {
+        uint64_t addr, num_fn_records;
+        if (!reader.Read(fn_base + 24 * i, addr) ||
+            !reader.Read(fn_base + 24 * i + 16, num_fn_records))
+            return 0;
+
+        for (uint64_t j = 0; j < num_fn_records; j++) {
+            uint64_t id;
+            uint32_t inst_off;
+            uint16_t num_locs, num_live_outs;
+            if (!reader.Read(rec_off, id) || !reader.Read(rec_off + 8, inst_off)
+                || !reader.Read(rec_off + 14, num_locs))
+                return 0;
+
+            // Skip locations (12 bytes each) and live-outs (4 bytes each).
+            std::size_t live_off = Align8(rec_off + 16 + 12 * num_locs);
+            if (!reader.Read(live_off + 2, num_live_outs))
+                return 0;
+            rec_off = Align8(live_off + 4 + 4 * num_live_outs);
+
+            if (addr == fn_addr && inst_off <= pc - fn_addr &&
+                (!result || inst_off >= best_off)) {
+                result = id;
+                best_off = inst_off;
+            }
+        }
+    }
+
+    return result;
+}
+
+} // namespace rellume
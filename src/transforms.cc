@@ -28,16 +28,22 @@
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
 #include <llvm/IR/GlobalValue.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <unordered_map>
 
 
 namespace rellume {
@@ -51,8 +57,206 @@ static llvm::Value* GepHelper(llvm::IRBuilder<>& irb, llvm::Value* base, llvm::A
     return irb.CreateGEP(base, consts);
 }
 
+/// Known alignment of an integer or pointer value: value % align == rem. An
+/// align of zero means that nothing was derived yet (optimistic top).
+struct KnownAlign {
+    static constexpr uint64_t kMax = 4096;
+
+    uint64_t align;
+    uint64_t rem;
+
+    static KnownAlign Top() { return {0, 0}; }
+    static KnownAlign Unknown() { return {1, 0}; }
+    static KnownAlign Const(uint64_t val) { return {kMax, val & (kMax - 1)}; }
+    static KnownAlign Aligned(uint64_t align) {
+        return align ? KnownAlign{std::min(align, kMax), 0} : Unknown();
+    }
+
+    bool IsTop() const { return align == 0; }
+    bool operator==(const KnownAlign& o) const {
+        return align == o.align && rem == o.rem;
+    }
+
+    /// Alignment of the value itself, i.e. the largest power of two dividing
+    /// all possible values.
+    uint64_t ValueAlign() const { return rem ? rem & -rem : align; }
+
+    KnownAlign Meet(KnownAlign o) const {
+        if (IsTop())
+            return o;
+        if (o.IsTop())
+            return *this;
+        uint64_t res_align = std::min(align, o.align);
+        uint64_t diff = (rem ^ o.rem) & (res_align - 1);
+        if (diff)
+            res_align = diff & -diff;
+        return {res_align, rem & (res_align - 1)};
+    }
+    KnownAlign Add(KnownAlign o, bool sub = false) const {
+        if (IsTop() || o.IsTop())
+            return Top();
+        uint64_t res_align = std::min(align, o.align);
+        uint64_t res_rem = sub ? rem - o.rem : rem + o.rem;
+        return {res_align, res_rem & (res_align - 1)};
+    }
+    KnownAlign Scale(uint64_t factor) const {
+        if (factor == 0)
+            return Const(0);
+        if (IsTop())
+            return Top();
+        uint64_t factor_align = std::min(factor & -factor, kMax);
+        uint64_t res_align = std::min(align * factor_align, kMax);
+        return {res_align, (rem * factor) & (res_align - 1)};
+    }
+    KnownAlign Mask(uint64_t mask) const {
+        if (mask == 0)
+            return Const(0);
+        if (IsTop())
+            return Top();
+        // The low bits cleared by the mask are known to be zero.
+        uint64_t res_align = std::max(align, std::min(mask & -mask, kMax));
+        return {res_align, rem & mask & (res_align - 1)};
+    }
+};
+
+class AlignmentInference {
+    const llvm::DataLayout& dl;
+    std::unordered_map<llvm::Value*, KnownAlign> facts;
+    std::unordered_map<llvm::Value*, KnownAlign> state;
+
+public:
+    AlignmentInference(const llvm::DataLayout& dl) : dl(dl) {}
+
+    void AddFact(llvm::Value* val, KnownAlign known) {
+        facts[val] = known;
+    }
+
+    KnownAlign Get(llvm::Value* val) {
+        if (auto it = facts.find(val); it != facts.end())
+            return it->second;
+        // Pointers in other address spaces are relative to a segment base,
+        // e.g. fs/gs, so the offset alone says nothing about the alignment.
+        llvm::Type* val_ty = val->getType();
+        if (val_ty->isPointerTy() && val_ty->getPointerAddressSpace() != 0)
+            return KnownAlign::Unknown();
+        if (auto it = state.find(val); it != state.end())
+            return it->second;
+        if (llvm::isa<llvm::Instruction>(val)) {
+            if (val_ty->isIntegerTy() || val_ty->isPointerTy())
+                return KnownAlign::Top();
+            return KnownAlign::Unknown();
+        }
+        if (auto ci = llvm::dyn_cast<llvm::ConstantInt>(val)) {
+            if (ci->getBitWidth() > 64)
+                return KnownAlign::Unknown();
+            return KnownAlign::Const(ci->getZExtValue());
+        }
+        if (llvm::isa<llvm::ConstantPointerNull>(val))
+            return KnownAlign::Const(0);
+        if (auto arg = llvm::dyn_cast<llvm::Argument>(val))
+            return KnownAlign::Aligned(arg->getParamAlignment());
+        if (auto glob = llvm::dyn_cast<llvm::GlobalObject>(val))
+            return KnownAlign::Aligned(glob->getAlignment());
+        if (auto ce = llvm::dyn_cast<llvm::ConstantExpr>(val)) {
+            if (ce->isCast())
+                return Get(ce->getOperand(0));
+        }
+        return KnownAlign::Unknown();
+    }
+
+    KnownAlign Compute(llvm::Instruction* inst);
+
+    /// Update the state for inst, returns whether it changed.
+    bool Update(llvm::Instruction* inst) {
+        llvm::Type* ty = inst->getType();
+        if (!ty->isIntegerTy() && !ty->isPointerTy())
+            return false;
+        KnownAlign known = Compute(inst);
+        auto [it, inserted] = state.try_emplace(inst, known);
+        if (inserted)
+            return true;
+        if (it->second == known)
+            return false;
+        it->second = known;
+        return true;
+    }
+};
+
+KnownAlign AlignmentInference::Compute(llvm::Instruction* inst) {
+    if (auto it = facts.find(inst); it != facts.end())
+        return it->second;
+    switch (inst->getOpcode()) {
+    case llvm::Instruction::Add:
+        return Get(inst->getOperand(0)).Add(Get(inst->getOperand(1)));
+    case llvm::Instruction::Sub:
+        return Get(inst->getOperand(0)).Add(Get(inst->getOperand(1)), true);
+    case llvm::Instruction::Mul:
+        if (auto ci = llvm::dyn_cast<llvm::ConstantInt>(inst->getOperand(1)))
+            if (ci->getBitWidth() <= 64)
+                return Get(inst->getOperand(0)).Scale(ci->getZExtValue());
+        return KnownAlign::Unknown();
+    case llvm::Instruction::Shl:
+        if (auto ci = llvm::dyn_cast<llvm::ConstantInt>(inst->getOperand(1)))
+            if (ci->getZExtValue() < 64)
+                return Get(inst->getOperand(0)).Scale(1ull << ci->getZExtValue());
+        return KnownAlign::Unknown();
+    case llvm::Instruction::And:
+        if (auto ci = llvm::dyn_cast<llvm::ConstantInt>(inst->getOperand(1)))
+            if (ci->getBitWidth() <= 64)
+                return Get(inst->getOperand(0)).Mask(ci->getSExtValue());
+        return KnownAlign::Unknown();
+    case llvm::Instruction::Trunc: {
+        KnownAlign known = Get(inst->getOperand(0));
+        unsigned bits = inst->getType()->getIntegerBitWidth();
+        if (bits < 64 && known.align > (1ull << bits))
+            known = KnownAlign{1ull << bits, known.rem & ((1ull << bits) - 1)};
+        return known;
+    }
+    case llvm::Instruction::ZExt:
+    case llvm::Instruction::SExt:
+    case llvm::Instruction::BitCast:
+    case llvm::Instruction::IntToPtr:
+    case llvm::Instruction::PtrToInt:
+    case llvm::Instruction::AddrSpaceCast:
+        return Get(inst->getOperand(0));
+    case llvm::Instruction::GetElementPtr: {
+        auto gep = llvm::cast<llvm::GetElementPtrInst>(inst);
+        KnownAlign known = Get(gep->getPointerOperand());
+        auto it = llvm::gep_type_begin(gep), end = llvm::gep_type_end(gep);
+        for (; it != end; ++it) {
+            llvm::Value* idx = it.getOperand();
+            if (llvm::StructType* sty = it.getStructTypeOrNull()) {
+                auto field = llvm::cast<llvm::ConstantInt>(idx)->getZExtValue();
+                uint64_t off = dl.getStructLayout(sty)->getElementOffset(field);
+                known = known.Add(KnownAlign::Const(off));
+            } else {
+                uint64_t size = dl.getTypeAllocSize(it.getIndexedType());
+                known = known.Add(Get(idx).Scale(size));
+            }
+        }
+        return known;
+    }
+    case llvm::Instruction::PHI: {
+        KnownAlign known = KnownAlign::Top();
+        for (llvm::Value* incoming : llvm::cast<llvm::PHINode>(inst)->incoming_values())
+            known = known.Meet(Get(incoming));
+        return known;
+    }
+    case llvm::Instruction::Select:
+        return Get(inst->getOperand(1)).Meet(Get(inst->getOperand(2)));
+    case llvm::Instruction::Call: {
+        auto call = llvm::cast<llvm::CallInst>(inst);
+        if (call->getIntrinsicID() == llvm::Intrinsic::ssa_copy)
+            return Get(call->getArgOperand(0));
+        return KnownAlign::Aligned(call->getRetAlignment());
+    }
+    default:
+        return KnownAlign::Unknown();
+    }
 }
 
+} // namespace
+
 void FastOpt(llvm::Function* llvm_fn) {
     // Run some optimization passes to remove most of the bloat
     llvm::legacy::FunctionPassManager pm(llvm_fn->getParent());
@@ -67,6 +271,35 @@ void FastOpt(llvm::Function* llvm_fn) {
     pm.doFinalization();
 }
 
+void InferAlignment(llvm::Function* llvm_fn, llvm::Value* entry_sp) {
+    AlignmentInference ai(llvm_fn->getParent()->getDataLayout());
+    // At a function entry, the return address was just pushed onto a 16-byte
+    // aligned stack.
+    if (entry_sp)
+        ai.AddFact(entry_sp, KnownAlign{16, 8});
+
+    // Iterate to a fixed point. Values start optimistically at the top and
+    // only decrease, so PHI cycles converge.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (llvm::Instruction& inst : llvm::instructions(llvm_fn))
+            changed |= ai.Update(&inst);
+    }
+
+    for (llvm::Instruction& inst : llvm::instructions(llvm_fn)) {
+        if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+            KnownAlign known = ai.Get(load->getPointerOperand());
+            if (!known.IsTop() && known.ValueAlign() > load->getAlignment())
+                load->setAlignment(known.ValueAlign());
+        } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+            KnownAlign known = ai.Get(store->getPointerOperand());
+            if (!known.IsTop() && known.ValueAlign() > store->getAlignment())
+                store->setAlignment(known.ValueAlign());
+        }
+    }
+}
+
 llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
                             std::size_t stack_size) {
     llvm::LLVMContext& ctx = orig_fn->getContext();
@@ -81,6 +314,7 @@ llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
     cpu_types.push_back(llvm::ArrayType::get(irb.getInt1Ty(), 8));
     cpu_types.push_back(llvm::ArrayType::get(irb.getInt64Ty(), 2));
     cpu_types.push_back(llvm::ArrayType::get(irb.getIntNTy(LL_VECTOR_REGISTER_SIZE), 16));
+    cpu_types.push_back(llvm::ArrayType::get(irb.getIntNTy(128), 8)); // x87
     llvm::Type* cpu_type = llvm::StructType::get(irb.getContext(), cpu_types);
 
     llvm::Value* alloca = irb.CreateAlloca(cpu_type, int{0});
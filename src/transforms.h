@@ -26,12 +26,17 @@
 
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Type.h>
+#include <llvm/IR/Value.h>
 #include <cstddef>
 
 
 namespace rellume {
 
 void FastOpt(llvm::Function* llvm_fn);
+/// Raise the alignment of loads and stores to the alignment known from their
+/// address computation. If non-null, entry_sp is assumed to be the stack
+/// pointer at a function entry as specified by the SysV ABI.
+void InferAlignment(llvm::Function* llvm_fn, llvm::Value* entry_sp = nullptr);
 llvm::Function* WrapSysVAbi(llvm::Function* orig_fn, llvm::FunctionType* fn_ty,
                             std::size_t stack_size);
 
@@ -3,10 +3,19 @@
 
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/TargetSelect.h>
 
+#include <algorithm>
+#include <csetjmp>
+#include <csignal>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -17,6 +26,7 @@
 #include <random>
 #include <sstream>
 #include <sys/mman.h>
+#include <ucontext.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -26,6 +36,19 @@
 static bool opt_verbose = false;
 static bool opt_jit = false;
 static bool opt_overflow_intrinsics = false;
+static bool opt_string_libcalls = false;
+static bool opt_adaptive_facets = false;
+static bool opt_x87_double = false;
+static bool opt_quality = false;
+static bool opt_call_function = false;
+static bool opt_tlb = false;
+static bool opt_stackmaps = false;
+static bool opt_block_cache = false;
+static bool opt_edge_coverage = false;
+static bool opt_native_calls = false;
+static bool opt_sandbox = false;
+static bool opt_stack_alignment = false;
+static bool opt_regcall = false;
 
 struct HexBuffer {
     uint8_t* buf;
@@ -38,6 +61,57 @@ struct HexBuffer {
     }
 };
 
+// Memory manager which keeps track of the stack map section.
+class StackMapMemoryManager : public llvm::SectionMemoryManager {
+public:
+    uint8_t* stackmaps = nullptr;
+    size_t stackmaps_size = 0;
+
+    uint8_t* allocateDataSection(uintptr_t size, unsigned align, unsigned id,
+                                 llvm::StringRef name, bool readonly) override {
+        uint8_t* res = llvm::SectionMemoryManager::allocateDataSection(
+                size, align, id, name, readonly);
+        if (name == ".llvm_stackmaps") {
+            stackmaps = res;
+            stackmaps_size = size;
+        }
+        return res;
+    }
+};
+
+// Compiler for the block cache, owns the compiled code.
+struct BlockCacheJit {
+    std::vector<std::unique_ptr<llvm::ExecutionEngine>> engines;
+    unsigned compiles = 0;
+
+    static void Compile(LLVMModuleRef mod, size_t count, LLVMValueRef* fns,
+                        void** code, void* user_arg) {
+        auto jit = static_cast<BlockCacheJit*>(user_arg);
+        std::vector<std::string> names;
+        for (size_t i = 0; i < count; i++)
+            names.push_back(llvm::unwrap<llvm::Function>(fns[i])->getName().str());
+
+        llvm::EngineBuilder builder(std::unique_ptr<llvm::Module>(llvm::unwrap(mod)));
+        builder.setEngineKind(llvm::EngineKind::JIT);
+        builder.setOptLevel(llvm::CodeGenOpt::None);
+        llvm::ExecutionEngine* engine = builder.create();
+        for (size_t i = 0; i < count; i++) {
+            uint64_t addr = engine ? engine->getFunctionAddress(names[i]) : 0;
+            code[i] = reinterpret_cast<void*>(addr);
+        }
+        jit->engines.emplace_back(engine);
+        jit->compiles += count;
+    }
+};
+
+static sigjmp_buf fault_jmp_buf;
+static uintptr_t fault_pc;
+
+static void FaultHandler(int sig, siginfo_t* info, void* ctx) {
+    fault_pc = static_cast<ucontext_t*>(ctx)->uc_mcontext.gregs[REG_RIP];
+    siglongjmp(fault_jmp_buf, 1);
+}
+
 struct CPU {
     uint8_t rip[8];
     uint8_t data[4096-8];
@@ -59,6 +133,14 @@ class TestCase {
 
     std::ostringstream& diagnostic;
     std::vector<std::pair<void*, size_t>> mem_maps;
+    /// Blocks entered from the dispatcher in the second block cache run
+    unsigned block_dispatches = 0;
+    /// Blocks compiled again after invalidation
+    unsigned block_recompiles = 0;
+    /// Unsupported instructions in the lifted function
+    unsigned unsupported = 0;
+    /// Whether the process-wide histogram differs from the function's
+    bool unsupported_mismatch = false;
 
     TestCase(std::ostringstream& diagnostic) : diagnostic(diagnostic) {}
 
@@ -146,6 +228,404 @@ class TestCase {
         return std::make_pair(key_str, value_str);
     }
 
+    // Compare metrics of the optimized IR against the budgets in the case.
+    bool CheckQuality(llvm::Function* fn, std::istringstream& argstream) {
+        unsigned insts = 0, sptr_loads = 0, sptr_stores = 0, phis = 0;
+        unsigned calls = 0, unaligned = 0, branches = 0, unbiased = 0;
+
+        llvm::Value* sptr = &*fn->arg_begin();
+        const llvm::DataLayout& dl = fn->getParent()->getDataLayout();
+        // Guest memory accesses with an alignment below their size.
+        auto is_unaligned = [&dl] (llvm::Type* ty, unsigned align) {
+            if (!align)
+                align = dl.getABITypeAlignment(ty);
+            return align < dl.getTypeStoreSize(ty);
+        };
+        for (llvm::Instruction& inst : llvm::instructions(fn)) {
+            insts++;
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                llvm::Value* ptr = load->getPointerOperand();
+                if (llvm::GetUnderlyingObject(ptr, dl) == sptr)
+                    sptr_loads++;
+                else
+                    unaligned += is_unaligned(load->getType(),
+                                              load->getAlignment());
+            } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+                llvm::Value* ptr = store->getPointerOperand();
+                if (llvm::GetUnderlyingObject(ptr, dl) == sptr)
+                    sptr_stores++;
+                else
+                    unaligned += is_unaligned(
+                        store->getValueOperand()->getType(),
+                        store->getAlignment());
+            } else if (llvm::isa<llvm::PHINode>(&inst)) {
+                phis++;
+            } else if (llvm::isa<llvm::CallInst>(&inst)) {
+                calls += !llvm::isa<llvm::IntrinsicInst>(&inst);
+            } else if (auto br = llvm::dyn_cast<llvm::BranchInst>(&inst)) {
+                // Conditional branches without branch weights favoring one
+                // direction, e.g. away from a trap.
+                uint64_t true_weight, false_weight;
+                if (br->isConditional()) {
+                    branches++;
+                    unbiased += !br->extractProfMetadata(true_weight,
+                                                         false_weight) ||
+                                true_weight == false_weight;
+                }
+            }
+        }
+
+        std::vector<std::pair<std::string, unsigned>> metrics = {
+            {"insts", insts}, {"sptr_loads", sptr_loads},
+            {"sptr_stores", sptr_stores}, {"phis", phis}, {"calls", calls},
+            {"unaligned", unaligned}, {"branches", branches},
+            {"unbiased_branches", unbiased},
+        };
+
+        bool fail = false;
+        std::string arg;
+        while (argstream >> arg) {
+            auto kv = split_arg(arg);
+            if (kv.first == "rip")
+                continue;
+            auto metric = std::find_if(metrics.begin(), metrics.end(),
+                                       [&kv] (const auto& m) {
+                return m.first == kv.first;
+            });
+            if (metric == metrics.end()) {
+                diagnostic << "# invalid metric: " << kv.first << std::endl;
+                fail = true;
+                continue;
+            }
+            unsigned budget = std::stoul(kv.second);
+            if (metric->second > budget) {
+                diagnostic << "# " << kv.first << " over budget: "
+                           << metric->second << " > " << budget << std::endl;
+                fail = true;
+            }
+        }
+
+        for (const auto& [name, value] : metrics)
+            diagnostic << "# " << name << ": " << value << std::endl;
+        return fail;
+    }
+
+    // Callee for call_function, which returns to the address on the stack
+    // plus R11. A non-zero R11 thus simulates an unexpected return address.
+    llvm::Function* CreateCallee(llvm::Module* mod) {
+        llvm::LLVMContext& ctx = mod->getContext();
+        llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+        llvm::Type* i64p = llvm::Type::getInt64PtrTy(ctx);
+        auto fn_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {i8p},
+                                             false);
+        auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                         "test_callee", mod);
+        llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", fn));
+        auto reg_ptr = [&] (const char* name) {
+            llvm::Value* ptr = irb.CreateConstGEP1_64(&*fn->arg_begin(),
+                                                      regs[name].offset);
+            return irb.CreatePointerCast(ptr, i64p);
+        };
+        llvm::Value* rsp = irb.CreateLoad(reg_ptr("rsp"));
+        llvm::Value* ret_addr = irb.CreateLoad(irb.CreateIntToPtr(rsp, i64p));
+        ret_addr = irb.CreateAdd(ret_addr, irb.CreateLoad(reg_ptr("r11")));
+        irb.CreateStore(ret_addr, reg_ptr("rip"));
+        irb.CreateStore(irb.CreateAdd(rsp, irb.getInt64(8)), reg_ptr("rsp"));
+        irb.CreateRetVoid();
+        return fn;
+    }
+
+    // Native functions which return their first argument minus the second,
+    // called instead of the guest code at 0x1000100 (i64) and 0x1000108
+    // (double).
+    void AddNativeCalls(llvm::Module* mod, LLConfig* rlcfg) {
+        llvm::LLVMContext& ctx = mod->getContext();
+        std::pair<uint64_t, llvm::Type*> natives[] = {
+            {0x1000100, llvm::Type::getInt64Ty(ctx)},
+            {0x1000108, llvm::Type::getDoubleTy(ctx)},
+        };
+        for (const auto& [addr, ty] : natives) {
+            auto fn_ty = llvm::FunctionType::get(ty, {ty, ty}, false);
+            auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                             "test_native", mod);
+            llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", fn));
+            llvm::Value* lhs = &fn->arg_begin()[0];
+            llvm::Value* rhs = &fn->arg_begin()[1];
+            irb.CreateRet(ty->isIntegerTy() ? irb.CreateSub(lhs, rhs)
+                                            : irb.CreateFSub(lhs, rhs));
+            ll_config_set_native_call(rlcfg, addr, llvm::wrap(fn));
+        }
+    }
+
+    // Shadow return stack holding 0x2000000 as return address of the lifted
+    // code, returns the variable holding the top.
+    llvm::GlobalVariable* CreateShadowStack(llvm::Module* mod) {
+        llvm::Type* i64 = llvm::Type::getInt64Ty(mod->getContext());
+        auto buf_ty = llvm::ArrayType::get(i64, 16);
+        std::vector<llvm::Constant*> entries(16, llvm::ConstantInt::get(i64, 0));
+        entries[15] = llvm::ConstantInt::get(i64, 0x2000000);
+        auto buf = new llvm::GlobalVariable(*mod, buf_ty, false,
+                                            llvm::GlobalValue::InternalLinkage,
+                                            llvm::ConstantArray::get(buf_ty, entries),
+                                            "shadow_stack");
+        llvm::Constant* idxs[] = {
+            llvm::ConstantInt::get(i64, 0), llvm::ConstantInt::get(i64, 15),
+        };
+        llvm::Constant* top =
+            llvm::ConstantExpr::getInBoundsGetElementPtr(buf_ty, buf, idxs);
+        return new llvm::GlobalVariable(*mod, top->getType(), false,
+                                        llvm::GlobalValue::InternalLinkage,
+                                        top, "shadow_stack_top");
+    }
+
+    // Wrapper taking a pointer to the CPU state around a REGCALL function,
+    // which passes RIP, the packed flags, RAX-RDI and the first four vector
+    // registers in host registers.
+    llvm::Function* CreateRegcallWrapper(llvm::Function* fn) {
+        llvm::Module* mod = fn->getParent();
+        llvm::LLVMContext& ctx = mod->getContext();
+        llvm::Type* i8 = llvm::Type::getInt8Ty(ctx);
+        llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        auto fn_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {i8p},
+                                             false);
+        auto wrapper = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                              "test_regcall_wrapper", mod);
+        llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", wrapper));
+        auto reg_ptr = [&] (std::string name, llvm::Type* ty) {
+            llvm::Value* ptr = irb.CreateConstGEP1_64(&*wrapper->arg_begin(),
+                                                      regs[name].offset);
+            return irb.CreatePointerCast(ptr, ty->getPointerTo());
+        };
+
+        static const char* const gp_names[] = {
+            "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        };
+        // Flags with their bit in RFLAGS.
+        static const std::pair<const char*, unsigned> flags[] = {
+            {"cf", 0}, {"pf", 2}, {"af", 4}, {"zf", 6}, {"sf", 7}, {"df", 10},
+            {"of", 11},
+        };
+        llvm::FunctionType* callee_ty = fn->getFunctionType();
+        unsigned vec_regs = callee_ty->getNumParams() - 11;
+
+        llvm::SmallVector<llvm::Value*, 16> args{&*wrapper->arg_begin()};
+        args.push_back(irb.CreateLoad(reg_ptr("rip", i64)));
+        llvm::Value* packed_flags = irb.getInt64(0);
+        for (const auto& [name, bit] : flags) {
+            llvm::Value* flag = irb.CreateLoad(reg_ptr(name, i8));
+            flag = irb.CreateShl(irb.CreateZExt(flag, i64), bit);
+            packed_flags = irb.CreateOr(packed_flags, flag);
+        }
+        args.push_back(packed_flags);
+        for (const char* name : gp_names)
+            args.push_back(irb.CreateLoad(reg_ptr(name, i64)));
+        for (unsigned i = 0; i < vec_regs; i++) {
+            llvm::Type* vec_ty = callee_ty->getParamType(11 + i);
+            std::string name = "xmm" + std::to_string(i);
+            args.push_back(irb.CreateLoad(reg_ptr(name, vec_ty)));
+        }
+
+        llvm::CallInst* res = irb.CreateCall(fn, args);
+        res->setCallingConv(fn->getCallingConv());
+        irb.CreateStore(irb.CreateExtractValue(res, 0), reg_ptr("rip", i64));
+        packed_flags = irb.CreateExtractValue(res, 1);
+        for (const auto& [name, bit] : flags) {
+            llvm::Value* flag = irb.CreateLShr(packed_flags, bit);
+            flag = irb.CreateAnd(irb.CreateTrunc(flag, i8), 1);
+            irb.CreateStore(flag, reg_ptr(name, i8));
+        }
+        for (unsigned i = 0; i < 8; i++)
+            irb.CreateStore(irb.CreateExtractValue(res, 2 + i),
+                            reg_ptr(gp_names[i], i64));
+        for (unsigned i = 0; i < vec_regs; i++) {
+            llvm::Value* vec = irb.CreateExtractValue(res, 10 + i);
+            std::string name = "xmm" + std::to_string(i);
+            irb.CreateStore(vec, reg_ptr(name, vec->getType()));
+        }
+        irb.CreateRetVoid();
+        return wrapper;
+    }
+
+    // Software TLB with an identity mapping, initially empty. The miss
+    // function fills the entry of the page.
+    llvm::Function* CreateTlb(llvm::Module* mod, unsigned bits,
+                              unsigned page_bits, llvm::GlobalVariable** tlb) {
+        llvm::LLVMContext& ctx = mod->getContext();
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::Type* i8p = llvm::Type::getInt8PtrTy(ctx);
+        auto entry_ty = llvm::StructType::get(i64, i64);
+        auto tlb_ty = llvm::ArrayType::get(entry_ty, 1 << bits);
+        auto invalid = llvm::ConstantStruct::get(entry_ty,
+                                                 {llvm::ConstantInt::get(i64, -1),
+                                                  llvm::ConstantInt::get(i64, 0)});
+        std::vector<llvm::Constant*> entries(1 << bits, invalid);
+        *tlb = new llvm::GlobalVariable(*mod, tlb_ty, false,
+                                        llvm::GlobalValue::InternalLinkage,
+                                        llvm::ConstantArray::get(tlb_ty, entries),
+                                        "tlb");
+
+        auto fn_ty = llvm::FunctionType::get(i8p, {i8p, i64}, false);
+        auto fn = llvm::Function::Create(fn_ty, llvm::GlobalValue::ExternalLinkage,
+                                         "test_tlb_miss", mod);
+        llvm::IRBuilder<> irb(llvm::BasicBlock::Create(ctx, "", fn));
+        llvm::Value* addr = &fn->arg_begin()[1];
+        llvm::Value* page = irb.CreateLShr(addr, page_bits);
+        llvm::Value* idx = irb.CreateAnd(page, (1 << bits) - 1);
+        llvm::Value* entry = irb.CreateGEP(*tlb, {irb.getInt64(0), idx});
+        irb.CreateStore(page, irb.CreateConstGEP2_32(entry_ty, entry, 0, 0));
+        irb.CreateStore(irb.getInt64(0),
+                        irb.CreateConstGEP2_32(entry_ty, entry, 0, 1));
+        irb.CreateRet(irb.CreateIntToPtr(addr, i8p));
+        return fn;
+    }
+
+    // Count the unsupported instructions of the function and compare them to
+    // the process-wide histogram, which was reset before lifting.
+    void CountUnsupported(LLFunc* rlfn) {
+        LLUnsupportedInstr func_buf[16], global_buf[16];
+        size_t func_size = ll_func_unsupported_instrs(rlfn, func_buf, 16);
+        size_t global_size = ll_unsupported_instrs(global_buf, 16);
+        func_size = std::min<size_t>(func_size, 16);
+
+        unsupported = 0;
+        unsupported_mismatch = func_size != std::min<size_t>(global_size, 16);
+        for (size_t i = 0; i < func_size; i++) {
+            unsupported += func_buf[i].count;
+            if (i < global_size && (func_buf[i].type != global_buf[i].type ||
+                                    func_buf[i].count != global_buf[i].count ||
+                                    func_buf[i].first_addr !=
+                                        global_buf[i].first_addr))
+                unsupported_mismatch = true;
+        }
+    }
+
+    // Read guest code only from memory mapped for the test case.
+    static size_t ReadMapped(size_t addr, uint8_t* buf, size_t size,
+                             void* user_arg) {
+        auto test_case = static_cast<TestCase*>(user_arg);
+        for (const auto& [map, map_size] : test_case->mem_maps) {
+            uintptr_t start = reinterpret_cast<uintptr_t>(map);
+            if (addr < start || addr >= start + map_size)
+                continue;
+            size = std::min(size, start + map_size - addr);
+            std::memcpy(buf, reinterpret_cast<uint8_t*>(addr), size);
+            return size;
+        }
+        return 0;
+    }
+
+    // Dispatch blocks until reaching one which can't be lifted, returns the
+    // number of blocks entered from here.
+    unsigned RunBlocks(LLBlockCache* cache, CPU* state) {
+        unsigned dispatches = 0;
+        while (true) {
+            uint64_t rip;
+            std::memcpy(&rip, state->rip, sizeof(rip));
+            void* code = ll_block_cache_translate(cache, rip, ReadMapped, this);
+            if (!code)
+                return dispatches;
+            reinterpret_cast<void(*)(CPU*)>(code)(state);
+            dispatches++;
+        }
+    }
+
+    // Emulate through the block cache. The case is run a second time with all
+    // blocks compiled and, if invalidate is set, a third time after
+    // invalidating the block at that address.
+    bool RunBlockCache(CPU* state, uint64_t invalidate) {
+        llvm::LLVMContext ctx;
+        BlockCacheJit jit;
+        LLConfig* rlcfg = ll_config_new();
+        ll_config_enable_verify_ir(rlcfg, true);
+        LLBlockCache* cache = ll_block_cache_new(rlcfg, llvm::wrap(&ctx),
+                                                 BlockCacheJit::Compile, &jit);
+
+        bool fail = false;
+        CPU initial = *state;
+        RunBlocks(cache, state);
+
+        CPU rerun = initial;
+        block_dispatches = RunBlocks(cache, &rerun);
+        fail |= std::memcmp(&rerun, state, sizeof(CPU)) != 0;
+
+        if (invalidate) {
+            ll_block_cache_invalidate(cache, invalidate, invalidate + 1);
+            unsigned compiles = jit.compiles;
+            rerun = initial;
+            RunBlocks(cache, &rerun);
+            block_recompiles = jit.compiles - compiles;
+            fail |= std::memcmp(&rerun, state, sizeof(CPU)) != 0;
+        }
+
+        ll_block_cache_dispose(cache);
+        ll_config_free(rlcfg);
+        if (fail)
+            diagnostic << "# error: block cache runs differ" << std::endl;
+        return fail;
+    }
+
+    // Compare with expected values
+    //  - memory is compared immediately
+    //  - registers are compared separately to support undefined values
+    bool CheckState(CPU& state, const CPU& initial,
+                    std::istringstream& argstream) {
+        bool fail = false;
+        std::string arg;
+        CPU expected = initial;
+
+        std::unordered_set<std::string> skip_regs;
+        while (argstream >> arg) {
+            auto kv = split_arg(arg);
+            if (kv.first[0] == 'm') {
+                fail |= CheckMem(kv.first, kv.second);
+            } else if (kv.first == "dispatches" || kv.first == "recompiles") {
+                unsigned value = kv.first == "dispatches" ? block_dispatches
+                                                          : block_recompiles;
+                if (value != std::stoul(kv.second)) {
+                    fail = true;
+                    diagnostic << "# unexpected " << kv.first << ": " << value
+                               << std::endl;
+                }
+            } else if (kv.first == "unsupported") {
+                if (unsupported != std::stoul(kv.second)) {
+                    fail = true;
+                    diagnostic << "# unexpected unsupported: " << unsupported
+                               << std::endl;
+                }
+                if (unsupported_mismatch) {
+                    fail = true;
+                    diagnostic << "# global unsupported instructions differ"
+                               << std::endl;
+                }
+            } else if (kv.second == "undef") {
+                skip_regs.insert(kv.first);
+            } else {
+                SetReg(kv.first, kv.second, &expected);
+            }
+        }
+
+        uint8_t* state_raw = reinterpret_cast<uint8_t*>(&state);
+        uint8_t* expected_raw = reinterpret_cast<uint8_t*>(&expected);
+        for (auto& reg_entry : regs) {
+            if (skip_regs.count(reg_entry.first) > 0)
+                continue;
+
+            size_t size = reg_entry.second.size;
+            size_t offset = reg_entry.second.offset;
+            uint8_t* expected_bytes = expected_raw + offset;
+            uint8_t* state_bytes = state_raw + offset;
+            if (memcmp(state_bytes, expected_bytes, size) != 0) {
+                fail = true;
+                diagnostic << "# unexpected value for " << reg_entry.first << std::endl;
+                diagnostic << "# expected: " << HexBuffer{expected_bytes, size} << std::endl;
+                diagnostic << "#      got: " << HexBuffer{state_bytes, size} << std::endl;
+            }
+        }
+
+        return fail;
+    }
+
     template<typename T>
     void Randomize(T& t) {
         using bytes_randomizer = std::independent_bits_engine<std::mt19937, CHAR_BIT, uint8_t>;
@@ -160,12 +640,17 @@ class TestCase {
     bool Run(std::string argstring) {
         std::istringstream argstream(argstring);
         std::string arg;
-        bool fail = false;
         bool should_pass = true;
+        uint64_t invalidate = 0;
 
         // 1. Setup initial state
         CPU initial{};
         Randomize(initial);
+        // Flags are passed as bits with REGCALL.
+        if (opt_regcall) {
+            for (const char* flag : {"cf", "pf", "af", "zf", "sf", "df", "of"})
+                reinterpret_cast<uint8_t*>(&initial)[regs[flag].offset] &= 1;
+        }
 
         while (argstream >> arg) {
             if (arg == "!") {
@@ -176,6 +661,8 @@ class TestCase {
                 auto kv = split_arg(arg);
                 if (kv.first[0] == 'm') {
                     AllocMem(kv.first, kv.second);
+                } else if (kv.first == "invalidate") {
+                    invalidate = std::stoul(kv.second, nullptr, 0);
                 } else {
                     SetReg(kv.first, kv.second, &initial);
                 }
@@ -191,15 +678,69 @@ class TestCase {
         // 2. Emulate function
         CPU state = initial;
 
+        if (opt_block_cache) {
+            if (RunBlockCache(&state, invalidate))
+                return true;
+            bool fail = CheckState(state, initial, argstream);
+            return should_pass ? fail : !fail;
+        }
+
         llvm::LLVMContext ctx;
         auto mod = std::make_unique<llvm::Module>("rellume_test", ctx);
 
         LLConfig* rlcfg = ll_config_new();
         ll_config_enable_verify_ir(rlcfg, true);
         ll_config_enable_overflow_intrinsics(rlcfg, opt_overflow_intrinsics);
+        ll_config_enable_string_libcalls(rlcfg, opt_string_libcalls);
+        ll_config_enable_adaptive_facets(rlcfg, opt_adaptive_facets);
+        ll_config_enable_x87_double(rlcfg, opt_x87_double);
+        ll_config_enable_rip_stackmaps(rlcfg, opt_stackmaps);
+        ll_config_enable_abi_stack_alignment(rlcfg, opt_stack_alignment);
+        // Alignment cases only check the IR, so fs/gs accesses can use native
+        // segment address spaces.
+        ll_config_set_use_native_segment_base(rlcfg, opt_stack_alignment);
+        if (opt_regcall)
+            ll_config_set_regcall(rlcfg, 4);
+        if (opt_call_function) {
+            ll_config_set_call_func(rlcfg, llvm::wrap(CreateCallee(mod.get())));
+            ll_config_set_shadow_ret_stack(rlcfg,
+                                           llvm::wrap(CreateShadowStack(mod.get())),
+                                           nullptr);
+        }
+        if (opt_tlb) {
+            llvm::GlobalVariable* tlb;
+            llvm::Function* miss_fn = CreateTlb(mod.get(), 4, 12, &tlb);
+            ll_config_set_tlb(rlcfg, llvm::wrap(tlb), 4, 12, llvm::wrap(miss_fn));
+        }
+        if (opt_native_calls)
+            AddNativeCalls(mod.get(), rlcfg);
+        if (opt_sandbox) {
+            // Guest addresses are masked to 16 bits and relative to
+            // 0x30000000, where the test case provides the memory.
+            llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+            auto base = llvm::ConstantExpr::getIntToPtr(
+                    llvm::ConstantInt::get(i64, 0x30000000),
+                    llvm::Type::getInt8PtrTy(ctx));
+            ll_config_set_sandbox(rlcfg, llvm::wrap(base), 0xffff);
+        }
+        if (opt_edge_coverage) {
+            // 16-byte map at 0x30000000 followed by prev_loc, both provided
+            // as memory by the test case.
+            llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+            auto map = llvm::ConstantExpr::getIntToPtr(
+                    llvm::ConstantInt::get(i64, 0x30000000),
+                    llvm::Type::getInt8PtrTy(ctx));
+            auto prev_loc = llvm::ConstantExpr::getIntToPtr(
+                    llvm::ConstantInt::get(i64, 0x30000010),
+                    llvm::Type::getInt64PtrTy(ctx));
+            ll_config_set_edge_coverage(rlcfg, llvm::wrap(map), 4,
+                                        llvm::wrap(prev_loc));
+        }
+        ll_unsupported_instrs_reset();
         LLFunc* rlfn = ll_func_new(llvm::wrap(mod.get()), rlcfg);
         bool decode_ok = !ll_func_decode_cfg(rlfn, *reinterpret_cast<uint64_t*>(&state.rip), nullptr, nullptr);
         LLVMValueRef fn_wrap = decode_ok ? ll_func_lift(rlfn) : nullptr;
+        CountUnsupported(rlfn);
         ll_func_dispose(rlfn);
         ll_config_free(rlcfg);
 
@@ -220,6 +761,13 @@ class TestCase {
         if (opt_verbose)
             fn->print(llvm::errs());
 
+        if (opt_quality) {
+            bool fail = CheckQuality(fn, argstream);
+            return should_pass ? fail : !fail;
+        }
+        if (opt_regcall)
+            fn = CreateRegcallWrapper(fn);
+
         std::string error;
 
         llvm::TargetOptions options;
@@ -237,12 +785,36 @@ class TestCase {
         builder.setOptLevel(llvm::CodeGenOpt::None);
         builder.setTargetOptions(options);
 
+        // With stack maps, a fault sets RIP to the faulting instruction.
+        StackMapMemoryManager* mem_mgr = nullptr;
+        if (opt_stackmaps) {
+            auto mem_mgr_owner = std::make_unique<StackMapMemoryManager>();
+            mem_mgr = mem_mgr_owner.get();
+            builder.setMCJITMemoryManager(std::move(mem_mgr_owner));
+        }
+
         if (llvm::ExecutionEngine* engine = builder.create()) {
             // If we have a JIT compiler, get address of compiled code.
             // Otherwise try to run the function using the interpreter.
             if (auto raw_ptr = engine->getFunctionAddress(fn->getName())) {
                 auto fn_ptr = reinterpret_cast<void(*)(CPU*)>(raw_ptr);
-                fn_ptr(&state);
+                if (!mem_mgr) {
+                    fn_ptr(&state);
+                } else {
+                    struct sigaction sa = {}, old_sa;
+                    sa.sa_sigaction = FaultHandler;
+                    sa.sa_flags = SA_SIGINFO;
+                    sigaction(SIGSEGV, &sa, &old_sa);
+                    if (!sigsetjmp(fault_jmp_buf, 1)) {
+                        fn_ptr(&state);
+                    } else {
+                        uint64_t rip = ll_stackmap_lookup(mem_mgr->stackmaps,
+                                                          mem_mgr->stackmaps_size,
+                                                          fault_pc);
+                        std::memcpy(state.rip, &rip, sizeof(rip));
+                    }
+                    sigaction(SIGSEGV, &old_sa, nullptr);
+                }
             } else {
                 engine->runFunction(fn, {llvm::PTOGV(&state)});
             }
@@ -253,40 +825,7 @@ class TestCase {
         }
 
         // 3. Compare with expected values
-        //  - memory is compared immediately
-        //  - registers are compared separately to support undefined values
-        CPU expected = initial;
-
-        std::unordered_set<std::string> skip_regs;
-        while (argstream >> arg) {
-            auto kv = split_arg(arg);
-            if (kv.first[0] == 'm') {
-                fail |= CheckMem(kv.first, kv.second);
-            } else if (kv.second == "undef") {
-                skip_regs.insert(kv.first);
-            } else {
-                SetReg(kv.first, kv.second, &expected);
-            }
-        }
-
-        uint8_t* state_raw = reinterpret_cast<uint8_t*>(&state);
-        uint8_t* expected_raw = reinterpret_cast<uint8_t*>(&expected);
-        for (auto& reg_entry : regs) {
-            if (skip_regs.count(reg_entry.first) > 0)
-                continue;
-
-            size_t size = reg_entry.second.size;
-            size_t offset = reg_entry.second.offset;
-            uint8_t* expected_bytes = expected_raw + offset;
-            uint8_t* state_bytes = state_raw + offset;
-            if (memcmp(state_bytes, expected_bytes, size) != 0) {
-                fail = true;
-                diagnostic << "# unexpected value for " << reg_entry.first << std::endl;
-                diagnostic << "# expected: " << HexBuffer{expected_bytes, size} << std::endl;
-                diagnostic << "#      got: " << HexBuffer{state_bytes, size} << std::endl;
-            }
-        }
-
+        bool fail = CheckState(state, initial, argstream);
         return should_pass ? fail : !fail;
     }
 
@@ -306,14 +845,29 @@ public:
 
 int main(int argc, char** argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "vji")) != -1) {
+    while ((opt = getopt(argc, argv, "vjisaxqctmbenokr")) != -1) {
         switch (opt) {
         case 'v': opt_verbose = true; break;
         case 'j': opt_jit = true; break;
         case 'i': opt_overflow_intrinsics = true; break;
+        case 's': opt_string_libcalls = true; break;
+        case 'a': opt_adaptive_facets = true; break;
+        case 'x': opt_x87_double = true; break;
+        case 'q': opt_quality = true; break;
+        case 'c': opt_call_function = true; break;
+        case 't': opt_tlb = true; break;
+        case 'm': opt_stackmaps = opt_jit = true; break;
+        case 'b': opt_block_cache = true; break;
+        case 'e': opt_edge_coverage = true; break;
+        case 'n': opt_native_calls = true; break;
+        case 'o': opt_sandbox = true; break;
+        case 'k': opt_stack_alignment = true; break;
+        case 'r': opt_regcall = true; break;
         default:
 usage:
-            std::cerr << "usage: " << argv[0] << " [-v] [-j] casefile" << std::endl;
+            std::cerr << "usage: " << argv[0] << " [-v] [-j] [-i] [-s] [-a]"
+                      << " [-x] [-q] [-c] [-t] [-m] [-b] [-e] [-n] [-o]"
+                      << " [-k] [-r] casefile" << std::endl;
             return 1;
         }
     }